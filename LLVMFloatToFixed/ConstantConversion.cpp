@@ -48,7 +48,7 @@ Constant *FloatToFixed::convertConstant(Constant *flt, FixedPointType& fixpt, Ty
 Constant *FloatToFixed::convertConstantExpr(ConstantExpr *cexp, FixedPointType& fixpt, TypeMatchPolicy typepol)
 {
   if (cexp->isGEPWithNoNotionalOverIndexing()) {
-    Value *newval = operandPool[cexp->getOperand(0)];
+    Value *newval = convertedValue(cexp->getOperand(0));
     if (!newval)
       return nullptr;
     Constant *newconst = dyn_cast<Constant>(newval);
@@ -11,7 +11,10 @@
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/APSInt.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "LLVMFloatToFixedPass.h"
 #include "TypeUtils.h"
 
@@ -20,6 +23,23 @@ using namespace flttofix;
 using namespace taffo;
 
 
+static CodegenOpt<bool> SaturatingArithmetic("flttofix-saturate",
+  cl::desc("Generate fixed point arithmetic and conversions which saturate "
+    "instead of wrapping around on overflow"),
+  cl::init(false));
+
+
+static CodegenOpt<bool> ReuseConversions("flttofix-reuse-conversions",
+  cl::desc("Reuse the code converting a value to a given format for all the "
+    "uses dominated by it"),
+  cl::init(true));
+
+static CodegenOpt<bool> HoistConversions("flttofix-hoist-conversions",
+  cl::desc("Place the conversions of loop-invariant values in the preheader "
+    "of the outermost loop where they are invariant"),
+  cl::init(true));
+
+
 Value *ConversionError = (Value *)(&ConversionError);
 Value *Unsupported = (Value *)(&Unsupported);
 
@@ -28,29 +48,46 @@ void FloatToFixed::performConversion(
   Module& m,
   std::vector<Value*>& q)
 {
+  /* The queue is mostly grouped by function; the timers of -time-passes
+   * and the -time-trace events are switched when the function changes */
+  Function *timedFun = nullptr;
+  Timer *funTimer = nullptr;
+  bool tracing = timeTraceProfilerEnabled();
   
-  for (auto i = q.begin(); i != q.end();) {
-    Value *v = *i;
+  /* the queue is numbered: the info and the converted value of the n-th
+   * value are info[n] and operandPool[n] */
+  for (unsigned n = 0; n < q.size(); n++) {
+    Value *v = q[n];
+    ValueInfo *vi = info[n];
     
-    if (CallInst *anno = dyn_cast<CallInst>(v)) {
-      if (anno->getCalledFunction()) {
-        if (anno->getCalledFunction()->getName() == "llvm.var.annotation") {
-          anno->eraseFromParent();
-          i = q.erase(i);
-          continue;
+    if (TimePassesIsEnabled || tracing) {
+      Instruction *inst = dyn_cast<Instruction>(v);
+      Function *fun = inst ? inst->getFunction() : nullptr;
+      if (fun != timedFun) {
+        if (funTimer)
+          funTimer->stopTimer();
+        if (tracing && timedFun)
+          timeTraceProfilerEnd();
+        funTimer = nullptr;
+        if (fun && TimePassesIsEnabled) {
+          funTimer = getFunctionTimer(fun);
+          funTimer->startTimer();
         }
+        if (fun && tracing)
+          timeTraceProfilerBegin("flttofix.function", fun->getName());
+        timedFun = fun;
       }
     }
     
     LLVM_DEBUG(dbgs() << "* performConversion *\n");
-    LLVM_DEBUG(dbgs() << "  [no conv ] " << valueInfo(v)->noTypeConversion << "\n");
+    LLVM_DEBUG(dbgs() << "  [no conv ] " << vi->noTypeConversion << "\n");
     LLVM_DEBUG(dbgs() << "  [value   ] " << *v << "\n");
     if (Instruction *i = dyn_cast<Instruction>(v))
       LLVM_DEBUG(dbgs() << "  [function] " << i->getFunction()->getName() << "\n");
     
-    Value *newv = convertSingleValue(m, v, valueInfo(v)->fixpType);
+    Value *newv = convertSingleValue(m, v, vi->fixpType);
     if (newv) {
-      operandPool[v] = newv;
+      operandPool[n] = newv;
     }
     
     if (newv && newv != ConversionError) {
@@ -64,23 +101,40 @@ void FloatToFixed::performConversion(
       if (newv != v) {
         if (hasInfo(newv)) {
           LLVM_DEBUG(dbgs() << "warning: output has valueInfo already from a previous conversion\n");
+          assert(fixPType(newv) == vi->fixpType && "one value converted to two different fixed point formats");
         } else {
-          *newValueInfo(newv) = *valueInfo(v);
+          *newValueInfo(newv) = *vi;
         }
       }
     } else {
       LLVM_DEBUG(dbgs() << "  [output  ] CONVERSION ERROR\n");
     }
-    i++;
   }
+  
+  if (funTimer)
+    funTimer->stopTimer();
+  if (tracing && timedFun)
+    timeTraceProfilerEnd();
+}
+
+
+bool FloatToFixed::isSaturating(Instruction *i)
+{
+  if (SaturatingArithmetic)
+    return true;
+  return i->getMetadata(SATURATE_METADATA) || i->getFunction()->getMetadata(SATURATE_METADATA);
 }
 
 
 Value *FloatToFixed::createPlaceholder(Type *type, BasicBlock *where, StringRef name)
 {
+  /* The placeholder is a load from an undefined address, which never needs
+   * a stack slot; all its uses are replaced during the conversion, and
+   * cleanup() erases it. */
   IRBuilder<> builder(where, where->getFirstInsertionPt());
-  AllocaInst *alloca = builder.CreateAlloca(type);
-  return builder.CreateLoad(type, alloca, name);
+  Instruction *placeh = builder.CreateLoad(type, UndefValue::get(type->getPointerTo()), name);
+  placeholders.push_back(placeh);
+  return placeh;
 }
 
 
@@ -120,28 +174,31 @@ Value *FloatToFixed::translateOrMatchOperand(Value *val, FixedPointType& iofixpt
     return genConvertFixedToFixed(tmp, iofixpt, origfixpt, ip);
   }
   
-  assert(val->getType()->getNumContainedTypes() == 0 && "translateOrMatchOperand val is not a scalar value");
-  Value *res = operandPool[val];
+  assert((val->getType()->getNumContainedTypes() == 0 || val->getType()->isVectorTy()) &&
+    "translateOrMatchOperand val is not a scalar or vector value");
+  ValueInfo *vi;
+  Value *res = convertedValue(val, vi);
   if (res) {
     if (res == ConversionError)
       /* the value should have been converted but it hasn't; bail out */
       return nullptr;
     
-    if (!valueInfo(val)->noTypeConversion) {
+    assert(vi && "value with no info");
+    if (!vi->noTypeConversion) {
       /* the value has been successfully converted to fixed point in a previous step */
       iofixpt = fixPType(res);
       return res;
     }
     
     /* The value has changed but may not a fixed point */
-    if (!res->getType()->isFloatingPointTy())
+    if (!res->getType()->isFPOrFPVectorTy())
       /* Don't attempt to convert ints/pointers to fixed point */
       return res;
     /* Otherwise convert to fixed point the value */
     val = res;
   }
 
-  assert(val->getType()->isFloatingPointTy());
+  assert(val->getType()->isFPOrFPVectorTy());
   
   /* try the easy cases first
    *   this is essentially duplicated from genConvertFloatToFix because once we
@@ -163,7 +220,7 @@ Value *FloatToFixed::translateOrMatchOperand(Value *val, FixedPointType& iofixpt
   
   /* not an easy case; check if the value has a range metadata
    * from VRA before giving up and using the suggested type */
-  mdutils::MDInfo *mdi = mdutils::MetadataManager::getMetadataManager().retrieveMDInfo(val);
+  mdutils::MDInfo *mdi = retrieveMDInfo(val);
   if (mdutils::InputInfo *ii = dyn_cast_or_null<mdutils::InputInfo>(mdi)) {
     if (ii->IRange) {
       FixedPointTypeGenError err;
@@ -177,9 +234,93 @@ Value *FloatToFixed::translateOrMatchOperand(Value *val, FixedPointType& iofixpt
 }
 
 
+DominatorTree& FloatToFixed::getDominatorTree(Function *f)
+{
+  /* The CFG never changes during the conversion */
+  std::unique_ptr<DominatorTree>& dt = domTreeCache[f];
+  if (!dt)
+    dt.reset(new DominatorTree(*f));
+  return *dt;
+}
+
+
+Value *FloatToFixed::findCachedConversion(const ConversionCacheKey& key, Instruction *ip, Instruction *&convip)
+{
+  if (!ReuseConversions)
+    return nullptr;
+  auto cached = conversionCache.find(key);
+  if (cached == conversionCache.end())
+    return nullptr;
+  Instruction *prev = dyn_cast_or_null<Instruction>(cached->second);
+  if (!prev || prev->getFunction() != ip->getFunction())
+    return nullptr;
+  
+  DominatorTree& dt = getDominatorTree(ip->getFunction());
+  if (dt.dominates(prev, ip)) {
+    ReusedConversionCount++;
+    return prev;
+  }
+  
+  /* Place the new conversion where it dominates the uses of the previous
+   * one as well, so that the following uses in either position reuse it */
+  BasicBlock *ncd = dt.findNearestCommonDominator(prev->getParent(), convip->getParent());
+  if (!ncd || ncd == convip->getParent())
+    return nullptr;
+  Instruction *ncdip = ncd->getTerminator();
+  Instruction *src = dyn_cast<Instruction>(std::get<0>(key));
+  if (!src || dt.dominates(src, ncdip))
+    convip = ncdip;
+  return nullptr;
+}
+
+
+void FloatToFixed::cacheConversion(const ConversionCacheKey& key, Value *res)
+{
+  if (!ReuseConversions || !isa<Instruction>(res) || res == std::get<0>(key))
+    return;
+  conversionCache[key] = res;
+}
+
+
+Instruction *FloatToFixed::getHoistedInsertionPoint(Value *v, Instruction *ip)
+{
+  if (!HoistConversions || !ip)
+    return ip;
+  
+  int vloop = -1;
+  if (Instruction *vinst = dyn_cast<Instruction>(v)) {
+    if (vinst->getFunction() != ip->getFunction())
+      return ip;
+    vloop = getInnermostLoop(vinst->getParent());
+  } else if (!isa<Argument>(v) && !isa<Constant>(v)) {
+    return ip;
+  }
+  
+  /* A value defined outside of a loop dominates the preheader of the loop
+   * whenever it dominates a use inside the loop, since the preheader is the
+   * only way into the loop from outside. */
+  Instruction *res = ip;
+  for (int loop = getInnermostLoop(ip->getParent()); loop >= 0; loop = loopNest[loop].parent) {
+    bool invariant = true;
+    for (int l = vloop; l >= 0 && invariant; l = loopNest[l].parent)
+      invariant = l != loop;
+    if (!invariant || !loopNest[loop].preheaderTerm)
+      break;
+    res = loopNest[loop].preheaderTerm;
+  }
+  
+  if (res != ip) {
+    LLVM_DEBUG(dbgs() << "conversion of " << *v << " used by " << *ip << " hoisted to preheader "
+                      << res->getParent()->getName() << "\n");
+    HoistedConversionCount++;
+  }
+  return res;
+}
+
+
 Value *FloatToFixed::genConvertFloatToFix(Value *flt, const FixedPointType& fixpt, Instruction *ip)
 {
-  assert(flt->getType()->isFloatingPointTy() && "genConvertFloatToFixed called on a non-float scalar");
+  assert(flt->getType()->isFPOrFPVectorTy() && "genConvertFloatToFixed called on a non-float scalar or vector");
   
   if (Constant *c = dyn_cast<Constant>(flt)) {
     FixedPointType fixptcopy = fixpt;
@@ -198,21 +339,34 @@ Value *FloatToFixed::genConvertFloatToFix(Value *flt, const FixedPointType& fixp
   }
   assert(ip && "ip is mandatory if not passing an instruction/constant value");
   
+  bool saturate = isSaturating(ip);
+  Instruction *convip = getHoistedInsertionPoint(flt, ip);
+  ConversionCacheKey key(flt, nullptr, fixpt.getOpaqueValue(), saturate);
+  if (Value *res = findCachedConversion(key, ip, convip))
+    return res;
+  
   FloatToFixCount++;
-  FloatToFixWeight += std::pow(2, std::min((int)(sizeof(int)*8-1), this->getLoopNestingLevelOfValue(flt)));
+  /* weighted on where the conversion is inserted, which is outside of the
+   * loops it was hoisted from */
+  FloatToFixWeight += std::pow(2, std::min((int)(sizeof(int)*8-1), this->getLoopNestingLevelOfValue(convip)));
   
-  IRBuilder<> builder(ip);
+  IRBuilder<> builder(convip);
   Type *destt = getLLVMFixedPointTypeForFloatType(flt->getType(), fixpt);
+  Value *res;
   
   /* insert new instructions before ip */
-  if (SIToFPInst *instr = dyn_cast<SIToFPInst>(flt)) {
+  if (saturate && (isa<SIToFPInst>(flt) || isa<UIToFPInst>(flt))) {
+    Value *intparam = cast<Instruction>(flt)->getOperand(0);
+    FixedPointType inttype(intparam->getType(), isa<SIToFPInst>(flt));
+    res = genConvertFixedToFixed(intparam, inttype, fixpt, ip);
+  } else if (SIToFPInst *instr = dyn_cast<SIToFPInst>(flt)) {
     Value *intparam = instr->getOperand(0);
-    return cpMetaData(builder.CreateShl(
+    res = cpMetaData(builder.CreateShl(
               cpMetaData(builder.CreateIntCast(intparam, destt, true),flt,ip),
             fixpt.scalarFracBitsAmt()),flt,ip);
   } else if (UIToFPInst *instr = dyn_cast<UIToFPInst>(flt)) {
     Value *intparam = instr->getOperand(0);
-    return cpMetaData(builder.CreateShl(
+    res = cpMetaData(builder.CreateShl(
               cpMetaData(builder.CreateIntCast(intparam, destt, false),flt,ip),
             fixpt.scalarFracBitsAmt()),flt,ip);
   } else {
@@ -220,12 +374,29 @@ Value *FloatToFixed::genConvertFloatToFix(Value *flt, const FixedPointType& fixp
     Value *interm = cpMetaData(builder.CreateFMul(
           cpMetaData(ConstantFP::get(flt->getType(), twoebits),flt,ip),
         flt),flt,ip);
+    if (saturate) {
+      /* fptosi/fptoui are undefined out of range; clamp to the largest
+       * values representable both in the float and in the fixed point type */
+      const fltSemantics& sem = flt->getType()->getScalarType()->getFltSemantics();
+      int bits = fixpt.scalarBitsAmt();
+      bool sign = fixpt.scalarIsSigned();
+      APFloat maxf(sem), minf(sem);
+      maxf.convertFromAPInt(sign ? APInt::getSignedMaxValue(bits) : APInt::getMaxValue(bits),
+        sign, APFloat::rmTowardZero);
+      minf.convertFromAPInt(sign ? APInt::getSignedMinValue(bits) : APInt::getMinValue(bits),
+        sign, APFloat::rmTowardZero);
+      interm = builder.CreateMinNum(interm, ConstantFP::get(flt->getType(), maxf));
+      interm = builder.CreateMaxNum(interm, ConstantFP::get(flt->getType(), minf));
+    }
     if (fixpt.scalarIsSigned()) {
-      return cpMetaData(builder.CreateFPToSI(interm, destt),flt,ip);
+      res = cpMetaData(builder.CreateFPToSI(interm, destt),flt,ip);
     } else {
-      return cpMetaData(builder.CreateFPToUI(interm, destt),flt,ip);
+      res = cpMetaData(builder.CreateFPToUI(interm, destt),flt,ip);
     }
   }
+  
+  cacheConversion(key, res);
+  return res;
 }
 
 
@@ -236,16 +407,55 @@ Value *FloatToFixed::genConvertFixedToFixed(Value *fix, const FixedPointType& sr
   
   Type *llvmsrct = fix->getType();
   assert(llvmsrct->isSingleValueType() && "cannot change fixed point format of a pointer");
-  assert(llvmsrct->isIntegerTy() && "cannot change fixed point format of a float");
+  assert(llvmsrct->isIntOrIntVectorTy() && "cannot change fixed point format of a float");
   
   Type *llvmdestt = destt.scalarToLLVMType(fix->getContext());
+  if (llvmsrct->isVectorTy())
+    llvmdestt = VectorType::get(llvmdestt, llvmsrct->getVectorNumElements());
   
   Instruction *fixinst = dyn_cast<Instruction>(fix);
   if (!ip && fixinst)
     ip = getFirstInsertionPointAfter(fixinst);
   assert(ip && "ip required when converted value not an instruction");
+  
+  bool saturate = isSaturating(ip);
+  Instruction *convip = getHoistedInsertionPoint(fix, ip);
+  ConversionCacheKey key(fix, srct.getOpaqueValue(), destt.getOpaqueValue(), saturate);
+  if (Value *res = findCachedConversion(key, ip, convip))
+    return res;
+
+  IRBuilder<> builder(convip);
 
-  IRBuilder<> builder(ip);
+  /* Clamps the value to the range of destt, expressed in the format of srct */
+  auto genSaturation = [&](Value *fix) -> Value* {
+    int srcbits = srct.scalarBitsAmt(), srcfrac = srct.scalarFracBitsAmt();
+    int dstbits = destt.scalarBitsAmt(), dstfrac = destt.scalarFracBitsAmt();
+    bool srcsign = srct.scalarIsSigned(), dstsign = destt.scalarIsSigned();
+    unsigned w = std::max(srcbits, dstbits) + std::abs(srcfrac - dstfrac) + 2;
+    
+    APInt dstmax = APInt::getLowBitsSet(w, dstbits - (dstsign ? 1 : 0));
+    APInt dstmin = dstsign ? -APInt::getOneBitSet(w, dstbits - 1) : APInt(w, 0);
+    if (srcfrac >= dstfrac) {
+      dstmax <<= srcfrac - dstfrac;
+      dstmin <<= srcfrac - dstfrac;
+    } else {
+      dstmax = dstmax.lshr(dstfrac - srcfrac);
+      dstmin = dstmin.sdiv(APInt::getOneBitSet(w, dstfrac - srcfrac));
+    }
+    APInt srcmax = srcsign ? APInt::getSignedMaxValue(srcbits).sext(w) : APInt::getMaxValue(srcbits).zext(w);
+    APInt srcmin = srcsign ? APInt::getSignedMinValue(srcbits).sext(w) : APInt(w, 0);
+    
+    if (dstmax.slt(srcmax)) {
+      Constant *maxc = ConstantInt::get(llvmsrct, dstmax.trunc(srcbits));
+      Value *over = srcsign ? builder.CreateICmpSGT(fix, maxc) : builder.CreateICmpUGT(fix, maxc);
+      fix = builder.CreateSelect(over, maxc, fix);
+    }
+    if (dstmin.sgt(srcmin)) {
+      Constant *minc = ConstantInt::get(llvmsrct, dstmin.trunc(srcbits));
+      fix = builder.CreateSelect(builder.CreateICmpSLT(fix, minc), minc, fix);
+    }
+    return fix;
+  };
 
   auto genSizeChange = [&](Value *fix) -> Value* {
     if (srct.scalarIsSigned()) {
@@ -269,9 +479,15 @@ Value *FloatToFixed::genConvertFixedToFixed(Value *fix, const FixedPointType& sr
     return fix;
   };
   
+  Value *res = fix;
+  if (saturate)
+    res = genSaturation(res);
   if (destt.scalarBitsAmt() > srct.scalarBitsAmt())
-    return genPointMovement(genSizeChange(fix));
-  return genSizeChange(genPointMovement(fix));
+    res = genPointMovement(genSizeChange(res));
+  else
+    res = genSizeChange(genPointMovement(res));
+  cacheConversion(key, res);
+  return res;
 }
 
 
@@ -283,7 +499,7 @@ Value *FloatToFixed::genConvertFixToFloat(Value *fix, const FixedPointType& fixp
   destt->print(dbgs());
   dbgs() << "\n";);
   
-  if (!fix->getType()->isIntegerTy()) {
+  if (!fix->getType()->isIntOrIntVectorTy()) {
     LLVM_DEBUG(errs() << "can't wrap-convert to flt non integer value ";
           fix->print(errs());
           errs() << "\n");
@@ -322,52 +538,7 @@ Value *FloatToFixed::genConvertFixToFloat(Value *fix, const FixedPointType& fixp
 
 Type *FloatToFixed::getLLVMFixedPointTypeForFloatType(Type *srct, const FixedPointType& baset, bool *hasfloats)
 {
-  if (srct->isPointerTy()) {
-    Type *enc = getLLVMFixedPointTypeForFloatType(srct->getPointerElementType(), baset, hasfloats);
-    if (enc)
-      return enc->getPointerTo();
-    return nullptr;
-    
-  } else if (srct->isArrayTy()) {
-    int nel = srct->getArrayNumElements();
-    Type *enc = getLLVMFixedPointTypeForFloatType(srct->getArrayElementType(), baset, hasfloats);
-    if (enc)
-      return ArrayType::get(enc, nel);
-    return nullptr;
-    
-  } else if (srct->isStructTy()) {
-    SmallVector<Type *, 2> elems;
-    bool allinvalid = true;
-    for (int i=0; i<srct->getStructNumElements(); i++) {
-      const FixedPointType& fpelemt = baset.structItem(i);
-      Type *baseelemt = srct->getStructElementType(i);
-      Type *newelemt;
-      if (!fpelemt.isInvalid()) {
-        allinvalid = false;
-        newelemt = getLLVMFixedPointTypeForFloatType(baseelemt, fpelemt, hasfloats);
-      } else {
-        newelemt = baseelemt;
-      }
-      elems.push_back(newelemt);
-    }
-    if (!allinvalid)
-      return StructType::get(srct->getContext(), elems, dyn_cast<StructType>(srct)->isPacked());
-    return srct;
-    
-  } else if (srct->isFloatingPointTy()) {
-    if (hasfloats)
-      *hasfloats = true;
-    return baset.scalarToLLVMType(srct->getContext());
-    
-  }
-  LLVM_DEBUG(
-    dbgs() << "getLLVMFixedPointTypeForFloatType given unexpected non-float type ";
-    srct->print(dbgs());
-    dbgs() << "\n";
-  );
-  if (hasfloats)
-    *hasfloats = false;
-  return srct;
+  return baset.toLLVMType(srct, hasfloats);
 }
 
 
@@ -0,0 +1,181 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/IntEqClasses.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "LLVMFloatToFixedPass.h"
+
+
+using namespace llvm;
+using namespace flttofix;
+
+
+static cl::opt<bool> PlanConversion("flttofix-plan",
+  cl::desc("Leave in floating point the groups of values whose conversions "
+    "from and to floating point, weighted by the estimated execution "
+    "frequency, cost more than the floating point operations they remove"),
+  cl::init(false));
+
+static cl::opt<double> PlanBoundaryCost("flttofix-plan-boundary-cost",
+  cl::desc("Cost of a conversion between floating and fixed point, relative "
+    "to the gain of converting one floating point operation"),
+  cl::init(2.0));
+
+
+bool FloatToFixed::isConversionPlanningEnabled()
+{
+  return PlanConversion;
+}
+
+
+double FloatToFixed::getBlockFrequency(BasicBlock *bb)
+{
+  auto cached = blockFreqCache.find(bb);
+  if (cached != blockFreqCache.end())
+    return cached->second;
+  
+  /* Frequencies are relative to the entry of the function. When profile
+   * data is present, BlockFrequencyInfo already takes the branch weights
+   * into account. */
+  Function *fun = bb->getParent();
+  BlockFrequencyInfo &bfi = getBlockFrequencyInfo(*fun);
+  double entry = std::max<uint64_t>(bfi.getEntryFreq(), 1);
+  for (BasicBlock &fbb: *fun)
+    blockFreqCache[&fbb] = bfi.getBlockFreq(&fbb).getFrequency() / entry;
+  return blockFreqCache[bb];
+}
+
+
+/** Returns if an instruction is a floating point operation which has a
+ *  cheaper fixed point equivalent. */
+static bool isFloatOperation(Instruction *inst)
+{
+  if (isa<BinaryOperator>(inst) || isa<UnaryOperator>(inst) || isa<IntrinsicInst>(inst))
+    return inst->getType()->isFPOrFPVectorTy();
+  if (isa<FCmpInst>(inst))
+    return true;
+  if (CastInst *cast = dyn_cast<CastInst>(inst))
+    return cast->getSrcTy()->isFPOrFPVectorTy() || cast->getDestTy()->isFPOrFPVectorTy();
+  return false;
+}
+
+
+void FloatToFixed::planConversion(std::vector<Value*>& vals)
+{
+  DenseMap<Value *, unsigned> queuePos;
+  for (unsigned i = 0; i < vals.size(); i++)
+    queuePos[vals[i]] = i;
+  /* the uses of the phis in the queue have been moved to their placeholders */
+  DenseMap<Value *, PHINode *> placeholderPhi;
+  for (auto& phiData: phiReplacementData) {
+    if (phiData.first)
+      placeholderPhi[phiData.second.placeh_noconv] = phiData.first;
+  }
+  auto getQueuePos = [&](Value *v) -> int {
+    if (PHINode *phi = placeholderPhi.lookup(v))
+      v = phi;
+    auto pos = queuePos.find(v);
+    return pos == queuePos.end() ? -1 : (int)pos->second;
+  };
+  
+  /* Values which cannot be left in floating point without affecting the
+   * rest of the conversion: memory, argument placeholders, returns and
+   * calls to converted functions */
+  BitVector fixedVal(vals.size());
+  for (unsigned i = 0; i < vals.size(); i++) {
+    Instruction *inst = dyn_cast<Instruction>(vals[i]);
+    if (!inst || isa<AllocaInst>(inst) || isa<ReturnInst>(inst) || inst->getType()->isPtrOrPtrVectorTy() ||
+        inst->mayReadOrWriteMemory() || callTargets.count(inst) || valueInfo(inst)->isArgumentPlaceholder)
+      fixedVal.set(i);
+  }
+  
+  /* A region is a set of movable values in the queue connected by def-use
+   * edges; either all or none of its values are converted. Each fixed value
+   * is a region on its own, and the edges to the fixed values (such as the
+   * loads and stores to the memory roots) are part of the boundary. */
+  IntEqClasses regions(vals.size());
+  for (unsigned i = 0; i < vals.size(); i++) {
+    Instruction *inst = dyn_cast<Instruction>(vals[i]);
+    if (!inst || fixedVal[i])
+      continue;
+    for (Value *op: inst->operands()) {
+      int j = getQueuePos(op);
+      if (j >= 0 && !fixedVal[j])
+        regions.join(i, j);
+    }
+  }
+  regions.compress();
+  
+  unsigned numRegions = regions.getNumClasses();
+  /* keepCost: conversions at the boundary of the region while it is
+   * converted; dropCost: conversions added at its boundary with the
+   * converted fixed values if it is left in floating point */
+  std::vector<double> gain(numRegions, 0.0), keepCost(numRegions, 0.0), dropCost(numRegions, 0.0);
+  BitVector fixed(numRegions);
+  
+  for (unsigned i = 0; i < vals.size(); i++) {
+    unsigned r = regions[i];
+    if (fixedVal[i])
+      fixed.set(r);
+    Instruction *inst = dyn_cast<Instruction>(vals[i]);
+    if (!inst)
+      continue;
+    
+    bool conv = !valueInfo(inst)->noTypeConversion;
+    double freq = getBlockFrequency(inst->getParent());
+    if (!fixedVal[i] && conv && isFloatOperation(inst))
+      gain[r] += freq;
+    
+    for (Use& u: inst->operands()) {
+      Value *op = u.get();
+      if (!op->getType()->isFPOrFPVectorTy() || isa<Constant>(op))
+        continue;
+      int j = getQueuePos(op);
+      bool opconv = j >= 0 && !valueInfo(vals[j])->noTypeConversion;
+      PHINode *phi = dyn_cast<PHINode>(inst);
+      double usefreq = (phi ? getBlockFrequency(phi->getIncomingBlock(u)) : freq) * PlanBoundaryCost;
+      /* a value is converted from floating point when it is used by a
+       * converted instruction, and back to floating point when it is used
+       * by an instruction which is not */
+      if (conv != opconv) {
+        keepCost[conv ? r : regions[j]] += usefreq;
+      } else if (conv && j >= 0 && fixedVal[i] != fixedVal[j]) {
+        dropCost[fixedVal[i] ? regions[j] : r] += usefreq;
+      }
+    }
+  }
+  
+  BitVector drop(numRegions);
+  for (unsigned r = 0; r < numRegions; r++) {
+    LLVM_DEBUG(dbgs() << "plan: region " << r << " gain=" << gain[r] << " boundary cost=" << keepCost[r]
+                      << " cost if dropped=" << dropCost[r] << (fixed[r] ? " (not movable)" : "") << "\n");
+    if (!fixed[r] && keepCost[r] > gain[r] + dropCost[r])
+      drop.set(r);
+  }
+  if (drop.none())
+    return;
+  
+  for (unsigned i = 0; i < vals.size(); i++) {
+    if (!drop[regions[i]])
+      continue;
+    LLVM_DEBUG(dbgs() << "plan: leaving in floating point " << *vals[i] << "\n");
+    if (PHINode *phi = dyn_cast<PHINode>(vals[i])) {
+      /* restore the uses moved to the placeholder; the placeholders
+       * themselves are erased by cleanup() */
+      auto phiIdx = phiReplacementIndex.find(phi);
+      if (phiIdx != phiReplacementIndex.end()) {
+        phiReplacementData[phiIdx->second].second.placeh_noconv->replaceAllUsesWith(phi);
+        phiReplacementData[phiIdx->second].first = nullptr;
+        phiReplacementIndex.erase(phiIdx);
+      }
+    }
+    vals[i] = nullptr;
+    PlannedOutCount++;
+  }
+  vals.erase(std::remove(vals.begin(), vals.end(), nullptr), vals.end());
+}
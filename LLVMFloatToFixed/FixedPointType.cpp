@@ -7,6 +7,7 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
 #include "TypeUtils.h"
 #include "FixedPointType.h"
@@ -19,54 +20,153 @@ using namespace mdutils;
 using namespace taffo;
 
 
+FixedPointTypeContext& FixedPointTypeContext::get()
+{
+  static FixedPointTypeContext ctx;
+  return ctx;
+}
+
+
+FixedPointType FixedPointTypeContext::getScalar(bool s, int f, int b)
+{
+  FixedPointType::Primitive scalar = {s, f, b};
+  FoldingSetNodeID id;
+  FixedPointType::Storage::Profile(id, scalar);
+  sys::ScopedLock guard(lock);
+  
+  void *insertPos;
+  FixedPointType::Storage *res = types.FindNodeOrInsertPos(id, insertPos);
+  if (!res) {
+    res = new (allocator.Allocate()) FixedPointType::Storage();
+    res->scalarData = scalar;
+    res->isStruct = false;
+    res->recursivelyInvalid = b == 0;
+    res->name = scalar.toString();
+    types.InsertNode(res, insertPos);
+  }
+  return FixedPointType(res);
+}
+
+
+FixedPointType FixedPointTypeContext::getStruct(ArrayRef<FixedPointType> elems)
+{
+  FoldingSetNodeID id;
+  FixedPointType::Storage::Profile(id, elems);
+  sys::ScopedLock guard(lock);
+  
+  void *insertPos;
+  FixedPointType::Storage *res = types.FindNodeOrInsertPos(id, insertPos);
+  if (!res) {
+    res = new (allocator.Allocate()) FixedPointType::Storage();
+    res->scalarData = {false, 0, 0};
+    res->structData.append(elems.begin(), elems.end());
+    res->isStruct = true;
+    res->recursivelyInvalid = false;
+    for (const FixedPointType& fpt: elems) {
+      if (fpt.isRecursivelyInvalid()) {
+        res->recursivelyInvalid = true;
+        break;
+      }
+    }
+    std::stringstream stm;
+    stm << '<';
+    for (size_t i = 0; i < elems.size(); i++) {
+      stm << elems[i].toString();
+      if (i != elems.size()-1)
+        stm << ',';
+    }
+    stm << '>';
+    res->name = stm.str();
+    types.InsertNode(res, insertPos);
+  }
+  return FixedPointType(res);
+}
+
+
+FixedPointTypeContext::LLVMTypeCaches& FixedPointTypeContext::getLLVMTypeCaches(LLVMContext& c)
+{
+  sys::ScopedLock guard(lock);
+  std::unique_ptr<LLVMTypeCaches>& caches = llvmTypeCaches[&c];
+  if (!caches)
+    caches.reset(new LLVMTypeCaches());
+  return *caches;
+}
+
+
+void FixedPointTypeContext::releaseLLVMTypeCaches(LLVMContext& c)
+{
+  sys::ScopedLock guard(lock);
+  llvmTypeCaches.erase(&c);
+}
+
+
+void FixedPointType::Storage::Profile(FoldingSetNodeID& id, const Primitive& scalar)
+{
+  id.AddBoolean(false);
+  id.AddBoolean(scalar.isSigned);
+  id.AddInteger(scalar.fracBitsAmt);
+  id.AddInteger(scalar.bitsAmt);
+}
+
+
+void FixedPointType::Storage::Profile(FoldingSetNodeID& id, ArrayRef<FixedPointType> elems)
+{
+  id.AddBoolean(true);
+  id.AddInteger(elems.size());
+  for (const FixedPointType& fpt: elems)
+    id.AddPointer(fpt.getOpaqueValue());
+}
+
+
+void FixedPointType::Storage::Profile(FoldingSetNodeID& id) const
+{
+  if (isStruct)
+    Profile(id, structData);
+  else
+    Profile(id, scalarData);
+}
+
+
 FixedPointType::FixedPointType()
 {
-  structData = nullptr;
-  scalarData = {false, 0, 0};
+  static const Storage *invalid = FixedPointTypeContext::get().getScalar(false, 0, 0).data;
+  data = invalid;
 }
 
 
 FixedPointType::FixedPointType(bool s, int f, int b)
 {
-  structData = nullptr;
-  scalarData = {s, f, b};
+  data = FixedPointTypeContext::get().getScalar(s, f, b).data;
 }
 
 
 FixedPointType::FixedPointType(Type *llvmtype, bool signd)
 {
-  structData = nullptr;
-  scalarData.isSigned = signd;
+  /* vectors have the same format in all the lanes */
+  llvmtype = llvmtype->getScalarType();
   if (isFloatType(llvmtype)) {
-    scalarData.fracBitsAmt = 0;
-    scalarData.bitsAmt = 0;
+    data = FixedPointTypeContext::get().getScalar(signd, 0, 0).data;
   } else if (llvmtype->isIntegerTy()) {
-    scalarData.fracBitsAmt = 0;
-    scalarData.bitsAmt = llvmtype->getIntegerBitWidth();
+    data = FixedPointTypeContext::get().getScalar(signd, 0, llvmtype->getIntegerBitWidth()).data;
   } else {
-    scalarData.isSigned = false;
-    scalarData.fracBitsAmt = 0;
-    scalarData.bitsAmt = 0;
+    data = FixedPointType().data;
   }
 }
 
 
 FixedPointType::FixedPointType(const ArrayRef<FixedPointType>& elems)
 {
-  structData.reset(new SmallVector<FixedPointType, 2>(elems.begin(), elems.end()));
+  data = FixedPointTypeContext::get().getStruct(elems).data;
 }
 
 
 FixedPointType::FixedPointType(TType *mdtype)
 {
-  structData = nullptr;
   FPType *fpt;
   if (mdtype && (fpt = dyn_cast<FPType>(mdtype))) {
-    scalarData.bitsAmt = fpt->getWidth();
-    scalarData.fracBitsAmt = fpt->getPointPos();
-    scalarData.isSigned = fpt->isSigned();
+    data = FixedPointTypeContext::get().getScalar(fpt->isSigned(), fpt->getPointPos(), fpt->getWidth()).data;
   } else {
-    scalarData = {false, 0, 0};
+    data = FixedPointType().data;
   }
 }
 
@@ -99,8 +199,8 @@ FixedPointType FixedPointType::get(MDInfo *mdnfo, int *enableConversion)
 
 Type *FixedPointType::scalarToLLVMType(LLVMContext& ctxt) const
 {
-  assert(!structData && "fixed point type not a scalar");
-  return Type::getIntNTy(ctxt, scalarData.bitsAmt);
+  assert(!data->isStruct && "fixed point type not a scalar");
+  return Type::getIntNTy(ctxt, data->scalarData.bitsAmt);
 }
 
 
@@ -116,92 +216,140 @@ std::string FixedPointType::Primitive::toString() const
 }
 
 
-std::string FixedPointType::toString() const
+const std::string& FixedPointType::toString() const
 {
-  std::stringstream stm;
-  
-  if (!structData) {
-    stm << scalarData.toString();
-  } else {
-    stm << '<';
-    for (int i=0; i<structData->size(); i++) {
-      stm << (*structData)[i].toString();
-      if (i != structData->size()-1)
-        stm << ',';
-    }
-    stm << '>';
-  }
-  
-  return stm.str();
+  return data->name;
+}
+
+
+/* Type indexed by n in a GEP index list */
+static Type *getIndexedType(Type *t, unsigned n)
+{
+  if (t->isPointerTy())
+    return t->getPointerElementType();
+  if (t->isArrayTy())
+    return t->getArrayElementType();
+  if (t->isVectorTy())
+    return t->getVectorElementType();
+  if (t->isStructTy())
+    return t->getStructElementType(n);
+  llvm_unreachable("unsupported type in GEP");
 }
 
 
-FixedPointType FixedPointType::unwrapIndexList(Type *valType, const iterator_range<const Use *> indices)
+FixedPointType FixedPointType::unwrapIndexList(Type *valType, const iterator_range<const Use *> indices) const
 {
+  /* only struct indices are relevant, and they are always constant; the
+   * other ones are all mapped to 0 so that they share the cache entries */
+  SmallVector<unsigned, 4> idxlist;
   Type *resolvedType = valType;
-  FixedPointType tempFixpt = *this;
   for (Value *a : indices) {
-    if (resolvedType->isPointerTy()) {
-      resolvedType = resolvedType->getPointerElementType();
-    } else if (resolvedType->isArrayTy()) {
-      resolvedType = resolvedType->getArrayElementType();
-    } else if (resolvedType->isVectorTy()) {
-      resolvedType = resolvedType->getVectorElementType();
-    } else if (resolvedType->isStructTy()) {
-      ConstantInt *val = dyn_cast<ConstantInt>(a);
-      assert(val && "non-constant index for struct in GEP");
-      int n = val->getZExtValue();
-      resolvedType = resolvedType->getStructElementType(n);
-      tempFixpt = tempFixpt.structItem(n);
-    } else {
-      assert("unsupported type in GEP");
+    unsigned n = 0;
+    if (resolvedType->isStructTy()) {
+      assert(isa<ConstantInt>(a) && "non-constant struct index");
+      n = cast<ConstantInt>(a)->getZExtValue();
     }
+    idxlist.push_back(n);
+    resolvedType = getIndexedType(resolvedType, n);
   }
-  return tempFixpt;
+  return unwrapIndexList(valType, ArrayRef<unsigned>(idxlist));
 }
 
 
-FixedPointType FixedPointType::unwrapIndexList(Type *valType, ArrayRef<unsigned> indices)
+FixedPointType FixedPointType::unwrapIndexList(Type *valType, ArrayRef<unsigned> indices) const
 {
+  if (!data->isStruct)
+    return *this;
+  
+  FixedPointTypeContext::LLVMTypeCaches& caches =
+    FixedPointTypeContext::get().getLLVMTypeCaches(valType->getContext());
+  auto cached = caches.unwrap.find({data, valType, indices});
+  if (cached != caches.unwrap.end())
+    return cached->second;
+  
   Type *resolvedType = valType;
   FixedPointType tempFixpt = *this;
   for (unsigned n : indices) {
-    if (resolvedType->isPointerTy()) {
-      resolvedType = resolvedType->getPointerElementType();
-    } else if (resolvedType->isArrayTy()) {
-      resolvedType = resolvedType->getArrayElementType();
-    } else if (resolvedType->isVectorTy()) {
-      resolvedType = resolvedType->getVectorElementType();
-    } else if (resolvedType->isStructTy()) {
-      resolvedType = resolvedType->getStructElementType(n);
+    if (resolvedType->isStructTy())
       tempFixpt = tempFixpt.structItem(n);
-    } else {
-      assert("unsupported type in GEP");
-    }
+    resolvedType = getIndexedType(resolvedType, n);
   }
+  
+  unsigned *ownedIndices = caches.indexLists.Allocate<unsigned>(indices.size());
+  std::copy(indices.begin(), indices.end(), ownedIndices);
+  caches.unwrap.insert({{data, valType, ArrayRef<unsigned>(ownedIndices, indices.size())}, tempFixpt});
   return tempFixpt;
 }
 
 
-raw_ostream& operator<<(raw_ostream& stm, const FixedPointType& f)
+Type *FixedPointType::toLLVMType(Type *srct, bool *hasfloats) const
 {
-  stm << f.toString();
-  return stm;
+  FixedPointTypeContext::LLVMTypeCaches& caches =
+    FixedPointTypeContext::get().getLLVMTypeCaches(srct->getContext());
+  auto cached = caches.llvmTypes.find({data, srct});
+  if (cached != caches.llvmTypes.end()) {
+    if (hasfloats)
+      *hasfloats = cached->second.hasFloats;
+    return cached->second.type;
+  }
+  
+  Type *res;
+  bool resHasFloats = false;
+  if (srct->isPointerTy()) {
+    res = toLLVMType(srct->getPointerElementType(), &resHasFloats)->getPointerTo();
+    
+  } else if (srct->isArrayTy()) {
+    int nel = srct->getArrayNumElements();
+    res = ArrayType::get(toLLVMType(srct->getArrayElementType(), &resHasFloats), nel);
+    
+  } else if (srct->isStructTy()) {
+    SmallVector<Type *, 2> elems;
+    bool allinvalid = true;
+    for (int i=0; i<srct->getStructNumElements(); i++) {
+      FixedPointType fpelemt = structItem(i);
+      Type *baseelemt = srct->getStructElementType(i);
+      Type *newelemt;
+      if (!fpelemt.isInvalid()) {
+        allinvalid = false;
+        bool elemHasFloats;
+        newelemt = fpelemt.toLLVMType(baseelemt, &elemHasFloats);
+        resHasFloats |= elemHasFloats;
+      } else {
+        newelemt = baseelemt;
+      }
+      elems.push_back(newelemt);
+    }
+    if (!allinvalid)
+      res = StructType::get(srct->getContext(), elems, cast<StructType>(srct)->isPacked());
+    else
+      res = srct;
+    
+  } else if (srct->isVectorTy()) {
+    int nel = srct->getVectorNumElements();
+    res = VectorType::get(toLLVMType(srct->getVectorElementType(), &resHasFloats), nel);
+    
+  } else if (srct->isFloatingPointTy()) {
+    resHasFloats = true;
+    res = scalarToLLVMType(srct->getContext());
+    
+  } else {
+    LLVM_DEBUG(
+      dbgs() << "getLLVMFixedPointTypeForFloatType given unexpected non-float type ";
+      srct->print(dbgs());
+      dbgs() << "\n";
+    );
+    res = srct;
+  }
+  
+  caches.llvmTypes[{data, srct}] = {res, resHasFloats};
+  if (hasfloats)
+    *hasfloats = resHasFloats;
+  return res;
 }
 
 
-bool FixedPointType::operator==(const FixedPointType& rhs) const
+raw_ostream& operator<<(raw_ostream& stm, const FixedPointType& f)
 {
-  if (!structData) {
-    return scalarData == rhs.scalarData;
-  } else {
-    if (structData->size() != rhs.structData->size())
-      return false;
-    for (int i=0; i<structData->size(); i++) {
-      if (!((*structData)[i] == (*rhs.structData)[i]))
-        return false;
-    }
-  }
-  return true;
+  stm << f.toString();
+  return stm;
 }
-
@@ -1,4 +1,6 @@
 #include <fstream>
+#include <map>
+#include <memory>
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
@@ -6,6 +8,10 @@
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/FoldingSet.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Mutex.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
@@ -19,6 +25,12 @@
 namespace flttofix {
 
 
+/** Fixed point type descriptor.
+ *  Instances are lightweight handles to immutable objects uniqued by
+ *  FixedPointTypeContext, thus two FixedPointType are equal if and only if
+ *  they refer to the same object. Derived information (LLVM type mapping,
+ *  index list unwrapping) is computed once and memoized by the context, for
+ *  each LLVMContext. */
 class FixedPointType {
 private:
   struct Primitive {
@@ -35,8 +47,15 @@ private:
     std::string toString() const;
   };
   
-  std::shared_ptr<llvm::SmallVector<FixedPointType, 2>> structData;
-  Primitive scalarData;
+public:
+  class Storage;
+  
+private:
+  const Storage *data;
+  
+  explicit FixedPointType(const Storage *d) : data(d) {};
+  
+  friend class FixedPointTypeContext;
   
 public:
   /** Default scalar type (invalid 0/0 parameters default) */
@@ -58,67 +77,168 @@ public:
   FixedPointType(mdutils::TType *mdtype);
   static FixedPointType get(mdutils::MDInfo *mdnfo, int *enableConversion = nullptr);
   
-  std::string toString() const;
+  const std::string& toString() const;
   
   llvm::Type *scalarToLLVMType(llvm::LLVMContext& ctxt) const;
-  inline bool& scalarIsSigned(void) {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.isSigned;
-  };
-  inline bool scalarIsSigned(void) const {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.isSigned;
+  inline bool scalarIsSigned(void) const;
+  inline int scalarFracBitsAmt(void) const;
+  inline int scalarBitsAmt(void) const;
+  
+  inline bool isStruct(void) const;
+  inline int structSize(void) const;
+  inline FixedPointType structItem(int n) const;
+  
+  inline bool isInvalid(void) const;
+  inline bool isRecursivelyInvalid(void) const;
+  
+  FixedPointType unwrapIndexList(llvm::Type *valType, const llvm::iterator_range<const llvm::Use*> indices) const;
+  FixedPointType unwrapIndexList(llvm::Type *valType, llvm::ArrayRef<unsigned> indices) const;
+  
+  /** Transforms a pre-existing LLVM type to a new LLVM type with integers
+   *  instead of floating point depending on this fixed point type.
+   *  The result is memoized per source type.
+   *  @param srct The original type
+   *  @param hasfloats If non-null, points to a bool which, on return,
+   *    will be true if at least one floating point type to transform to
+   *    fixed point was encountered.
+   *  @returns The new LLVM type. */
+  llvm::Type *toLLVMType(llvm::Type *srct, bool *hasfloats = nullptr) const;
+  
+  bool operator==(const FixedPointType& rhs) const {
+    return data == rhs.data;
   };
-  inline int& scalarFracBitsAmt(void) {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.fracBitsAmt;
+  bool operator!=(const FixedPointType& rhs) const {
+    return data != rhs.data;
   };
-  inline int scalarFracBitsAmt(void) const {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.fracBitsAmt;
+  /** Arbitrary strict ordering, for use in ordered containers */
+  bool operator<(const FixedPointType& rhs) const {
+    return std::less<const Storage *>()(data, rhs.data);
   };
-  inline int& scalarBitsAmt(void) {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.bitsAmt;
+  
+  /** Opaque pointer uniquely identifying this type, for use as a map key */
+  const void *getOpaqueValue() const {
+    return data;
   };
-  inline int scalarBitsAmt(void) const {
-    assert(!structData && "fixed point type not a scalar");
-    return scalarData.bitsAmt;
+};
+
+
+/** Uniqued representation of a fixed point type. Never modified after
+ *  creation. */
+class FixedPointType::Storage : public llvm::FoldingSetNode {
+public:
+  Primitive scalarData;
+  llvm::SmallVector<FixedPointType, 2> structData;
+  bool isStruct;
+  bool recursivelyInvalid;
+  
+  /** Printed name, computed on creation */
+  std::string name;
+  
+  static void Profile(llvm::FoldingSetNodeID& id, const Primitive& scalar);
+  static void Profile(llvm::FoldingSetNodeID& id, llvm::ArrayRef<FixedPointType> elems);
+  void Profile(llvm::FoldingSetNodeID& id) const;
+};
+
+
+/** Owner of all the uniqued fixed point types.
+ *  Creating types is thread safe. The memoized information which references
+ *  LLVM types is kept apart for each LLVMContext and, like the LLVMContext
+ *  itself, must be queried from one thread at a time. */
+class FixedPointTypeContext {
+public:
+  /** Memoized information about the LLVM types of one LLVMContext */
+  struct LLVMTypeCaches {
+    struct LLVMTypeMapping {
+      llvm::Type *type;
+      bool hasFloats;
+    };
+    llvm::DenseMap<std::pair<const FixedPointType::Storage *, llvm::Type *>, LLVMTypeMapping> llvmTypes;
+    
+    /** Key of unwrap. The index lists of the keys in the map are owned
+     *  by indexLists. */
+    struct UnwrapKey {
+      const FixedPointType::Storage *fixpt;
+      llvm::Type *type;
+      llvm::ArrayRef<unsigned> indices;
+    };
+    struct UnwrapKeyInfo {
+      static UnwrapKey getEmptyKey() {
+        return {nullptr, llvm::DenseMapInfo<llvm::Type *>::getEmptyKey(), {}};
+      }
+      static UnwrapKey getTombstoneKey() {
+        return {nullptr, llvm::DenseMapInfo<llvm::Type *>::getTombstoneKey(), {}};
+      }
+      static unsigned getHashValue(const UnwrapKey& k) {
+        return llvm::hash_combine(k.fixpt, k.type, llvm::hash_combine_range(k.indices.begin(), k.indices.end()));
+      }
+      static bool isEqual(const UnwrapKey& a, const UnwrapKey& b) {
+        return a.fixpt == b.fixpt && a.type == b.type && a.indices == b.indices;
+      }
+    };
+    llvm::DenseMap<UnwrapKey, FixedPointType, UnwrapKeyInfo> unwrap;
+    llvm::BumpPtrAllocator indexLists;
   };
   
-  inline int structSize(void) const {
-    assert(structData && "fixed point type not a struct");
-    return structData->size();
-  }
-  inline FixedPointType& structItem(int n) {
-    assert(structData && "fixed point type not a struct");
-    return (*structData)[n];
-  }
-  inline FixedPointType structItem(int n) const {
-    assert(structData && "fixed point type not a struct");
-    return (*structData)[n];
-  }
-  
-  inline bool isInvalid(void) const {
-    return !structData && (scalarData.bitsAmt == 0);
-  }
-  inline bool isRecursivelyInvalid(void) const {
-    if (!structData)
-      return scalarData.bitsAmt == 0;
-    for (FixedPointType& fpt: *structData) {
-      if (fpt.isRecursivelyInvalid())
-        return true;
-    }
-    return false;
-  }
-  
-  FixedPointType unwrapIndexList(llvm::Type *valType, const llvm::iterator_range<const llvm::Use*> indices);
-  FixedPointType unwrapIndexList(llvm::Type *valType, llvm::ArrayRef<unsigned> indices);
-  
-  bool operator==(const FixedPointType& rhs) const;
+private:
+  llvm::FoldingSet<FixedPointType::Storage> types;
+  llvm::SpecificBumpPtrAllocator<FixedPointType::Storage> allocator;
+  llvm::DenseMap<llvm::LLVMContext *, std::unique_ptr<LLVMTypeCaches>> llvmTypeCaches;
+  llvm::sys::Mutex lock;
+  
+  FixedPointTypeContext() = default;
+  
+public:
+  static FixedPointTypeContext& get();
+  
+  FixedPointType getScalar(bool s, int f, int b);
+  FixedPointType getStruct(llvm::ArrayRef<FixedPointType> elems);
+  
+  /** Returns the memoized information about the types of an LLVMContext */
+  LLVMTypeCaches& getLLVMTypeCaches(llvm::LLVMContext& c);
+  /** Drops the memoized information about the types of an LLVMContext.
+   *  Must be called before that LLVMContext goes away. */
+  void releaseLLVMTypeCaches(llvm::LLVMContext& c);
 };
 
 
+inline bool FixedPointType::scalarIsSigned(void) const {
+  assert(!data->isStruct && "fixed point type not a scalar");
+  return data->scalarData.isSigned;
+}
+
+inline int FixedPointType::scalarFracBitsAmt(void) const {
+  assert(!data->isStruct && "fixed point type not a scalar");
+  return data->scalarData.fracBitsAmt;
+}
+
+inline int FixedPointType::scalarBitsAmt(void) const {
+  assert(!data->isStruct && "fixed point type not a scalar");
+  return data->scalarData.bitsAmt;
+}
+
+inline bool FixedPointType::isStruct(void) const {
+  return data->isStruct;
+}
+
+inline int FixedPointType::structSize(void) const {
+  assert(data->isStruct && "fixed point type not a struct");
+  return data->structData.size();
+}
+
+inline FixedPointType FixedPointType::structItem(int n) const {
+  assert(data->isStruct && "fixed point type not a struct");
+  return data->structData[n];
+}
+
+inline bool FixedPointType::isInvalid(void) const {
+  return !data->isStruct && (data->scalarData.bitsAmt == 0);
+}
+
+inline bool FixedPointType::isRecursivelyInvalid(void) const {
+  return data->recursivelyInvalid;
+}
+
+
 }
 
 
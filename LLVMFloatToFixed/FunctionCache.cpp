@@ -0,0 +1,261 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "LLVMFloatToFixedPass.h"
+
+
+using namespace llvm;
+using namespace flttofix;
+
+
+static cl::opt<std::string> FunctionCacheDir("flttofix-cache-dir",
+  cl::desc("Directory of the persistent cache of converted functions "
+    "(the cache is disabled if not specified)"),
+  cl::init(""));
+
+/* Bump when the conversion of a function body changes in a way which does
+ * not depend on a codegen option (see registerCodegenOption) */
+static const char *FunctionCacheVersion = "flttofix-function-cache-4";
+/* Name of the converted function in the modules stored in the cache */
+static const char *CachedFunctionName = "flttofix.cached";
+
+
+/** Returns if a constant refers to a global object which is not a
+ *  function declaration */
+static bool usesDefinedGlobal(Constant *c)
+{
+  if (Function *f = dyn_cast<Function>(c))
+    return !f->isDeclaration();
+  if (isa<GlobalValue>(c))
+    return true;
+  for (Value *op: c->operands()) {
+    if (usesDefinedGlobal(cast<Constant>(op)))
+      return true;
+  }
+  return false;
+}
+
+
+static std::map<std::string, std::function<void (raw_ostream&)>>& getCodegenOptions()
+{
+  /* constructed on first use, as options register themselves during the
+   * static initialization of any translation unit */
+  static std::map<std::string, std::function<void (raw_ostream&)>> opts;
+  return opts;
+}
+
+
+void flttofix::registerCodegenOption(StringRef name, std::function<void (raw_ostream&)> print)
+{
+  getCodegenOptions()[name.str()] = print;
+}
+
+
+void flttofix::printCodegenOptions(raw_ostream& stm)
+{
+  for (auto& opt: getCodegenOptions()) {
+    stm << opt.first << "=";
+    opt.second(stm);
+    stm << "\n";
+  }
+}
+
+
+bool FloatToFixed::isFunctionCacheEnabled()
+{
+  return !FunctionCacheDir.empty();
+}
+
+
+/* The conversion of a function only depends on its body, on its metadata, on
+ * its fixed point signature, on the target and on the codegen options, as long as it does not reference other functions
+ * or global variables which are converted as well, or math functions replaced
+ * by the fixed point math runtime. */
+bool FloatToFixed::isCacheableFunction(Function *oldF)
+{
+  /* the conversion planner may leave part of the body in floating point
+   * depending on how the function is used */
+  if (isConversionPlanningEnabled())
+    return false;
+  for (Instruction &inst: instructions(oldF)) {
+    /* the runtime functions are linked only when they are used by code
+     * converted in this run */
+    CallSite call(&inst);
+    if (call && isMathRuntimeCall(&call))
+      return false;
+    for (Value *op: inst.operands()) {
+      Constant *c = dyn_cast<Constant>(op);
+      if (c && usesDefinedGlobal(c))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+std::string FloatToFixed::getFunctionCacheKey(ModuleSlotTracker& mst, Function *oldF, Function *newF,
+  const FixedPointSignature& fixArgs)
+{
+  Module *m = oldF->getParent();
+  std::string buf;
+  raw_string_ostream stm(buf);
+  
+  stm << FunctionCacheVersion << "\n";
+  stm << m->getTargetTriple() << "\n" << m->getDataLayoutStr() << "\n";
+  printCodegenOptions(stm);
+  oldF->Value::print(stm, mst);
+  
+  SmallVector<std::pair<unsigned, MDNode *>, 4> mds;
+  oldF->getAllMetadata(mds);
+  for (auto& md: mds)
+    md.second->printTree(stm, mst, m);
+  for (Instruction &inst: instructions(oldF)) {
+    inst.getAllMetadataOtherThanDebugLoc(mds);
+    for (auto& md: mds)
+      md.second->printTree(stm, mst, m);
+  }
+  
+  for (auto& arg: fixArgs)
+    stm << arg.first << ":" << arg.second << "\n";
+  newF->getFunctionType()->print(stm);
+  stm.flush();
+  
+  MD5 hash;
+  hash.update(buf);
+  MD5::MD5Result res;
+  hash.final(res);
+  SmallString<32> hexres;
+  MD5::stringifyResult(res, hexres);
+  return hexres.str().str();
+}
+
+
+static std::string getFunctionCachePath(const std::string& key)
+{
+  SmallString<128> path(FunctionCacheDir);
+  sys::path::append(path, key + ".bc");
+  return path.str().str();
+}
+
+
+bool FloatToFixed::loadCachedFunction(Function *newF, const std::string& key)
+{
+  std::string path = getFunctionCachePath(key);
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+  if (!buf)
+    return false;
+  
+  Expected<std::unique_ptr<Module>> cm = parseBitcodeFile((*buf)->getMemBufferRef(), newF->getContext());
+  if (!cm) {
+    LLVM_DEBUG(dbgs() << "function cache: cannot read " << path << ": " << toString(cm.takeError()) << "\n");
+    return false;
+  }
+  
+  /* types are uniqued in the context, thus a mismatch means that the named
+   * structures of the cached module have been renamed */
+  Function *cachedF = (*cm)->getFunction(CachedFunctionName);
+  if (!cachedF || cachedF->isDeclaration() || cachedF->getFunctionType() != newF->getFunctionType()) {
+    LLVM_DEBUG(dbgs() << "function cache: " << path << " does not match " << newF->getName() << "\n");
+    return false;
+  }
+  if (!(*cm)->global_empty())
+    return false;
+  
+  Module *m = newF->getParent();
+  ValueToValueMapTy vmap;
+  for (Function &f: **cm) {
+    if (&f == cachedF)
+      continue;
+    vmap[&f] = m->getOrInsertFunction(f.getName(), f.getFunctionType(), f.getAttributes()).getCallee();
+  }
+  auto newIt = newF->arg_begin();
+  for (Argument &arg: cachedF->args()) {
+    newIt->setName(arg.getName());
+    vmap[&arg] = &(*newIt);
+    newIt++;
+  }
+  
+  SmallVector<ReturnInst*, 8> returns;
+  CloneFunctionInto(newF, cachedF, vmap, true, returns);
+  LLVM_DEBUG(dbgs() << "function cache: restored " << newF->getName() << " from " << path << "\n");
+  FunctionCacheHits++;
+  return true;
+}
+
+
+void FloatToFixed::saveCachedFunctions()
+{
+  for (auto& clone: cacheableClones) {
+    Function *newF = clone.first;
+    Module *m = newF->getParent();
+    
+    Module cm("flttofix.cache", newF->getContext());
+    cm.setDataLayout(m->getDataLayout());
+    cm.setTargetTriple(m->getTargetTriple());
+    Function *cachedF = Function::Create(newF->getFunctionType(), GlobalValue::ExternalLinkage, CachedFunctionName, &cm);
+    
+    ValueToValueMapTy vmap;
+    bool valid = true;
+    for (Instruction &inst: instructions(newF)) {
+      for (Value *op: inst.operands()) {
+        Constant *c = dyn_cast<Constant>(op);
+        if (!c)
+          continue;
+        if (usesDefinedGlobal(c)) {
+          valid = false;
+          break;
+        }
+        Function *callee = dyn_cast<Function>(c->stripPointerCasts());
+        if (!callee || vmap.count(callee))
+          continue;
+        Function *decl = Function::Create(callee->getFunctionType(), GlobalValue::ExternalLinkage, callee->getName(), &cm);
+        decl->copyAttributesFrom(callee);
+        vmap[callee] = decl;
+      }
+    }
+    if (!valid) {
+      LLVM_DEBUG(dbgs() << "function cache: " << newF->getName() << " references global values; not saved\n");
+      continue;
+    }
+    
+    auto cachedIt = cachedF->arg_begin();
+    for (Argument &arg: newF->args()) {
+      cachedIt->setName(arg.getName());
+      vmap[&arg] = &(*cachedIt);
+      cachedIt++;
+    }
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(cachedF, newF, vmap, true, returns);
+    
+    /* write to a temporary file and rename it, so that concurrent builds
+     * never observe a partially written entry */
+    std::string path = getFunctionCachePath(clone.second);
+    SmallString<128> tmpPath;
+    int fd;
+    if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmpPath)) {
+      LLVM_DEBUG(dbgs() << "function cache: cannot create " << path << "\n");
+      continue;
+    }
+    {
+      raw_fd_ostream os(fd, true);
+      WriteBitcodeToFile(cm, os);
+    }
+    if (sys::fs::rename(tmpPath, path))
+      sys::fs::remove(tmpPath);
+    LLVM_DEBUG(dbgs() << "function cache: saved " << newF->getName() << " to " << path << "\n");
+  }
+  cacheableClones.clear();
+}
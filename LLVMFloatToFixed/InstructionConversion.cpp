@@ -8,6 +8,7 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/APSInt.h"
 #include "llvm/ADT/APFloat.h"
@@ -23,6 +24,18 @@ using namespace taffo;
 #define defaultFixpType @SYNTAX_ERROR@
 
 
+static CodegenOpt<bool> UseFixedPointIntrinsics("flttofix-fixp-intrinsics",
+  cl::desc("Convert floating point multiplications and divisions to the "
+    "llvm.*mul.fix and llvm.*div.fix intrinsics when possible"),
+  cl::init(false));
+
+static CodegenOpt<bool> UseReciprocalForConstantDivisor("flttofix-const-div-reciprocal",
+  cl::desc("Convert floating point divisions by a constant to multiplications "
+    "by the fixed point reciprocal of the constant (the result may differ from "
+    "the one of the division in the least significant bit)"),
+  cl::init(false));
+
+
 /* also inserts the new value in the basic blocks, alongside the old one */
 Value *FloatToFixed::convertInstruction(Module& m, Instruction *val, FixedPointType& fixpt)
 {
@@ -40,6 +53,12 @@ Value *FloatToFixed::convertInstruction(Module& m, Instruction *val, FixedPointT
     res = convertExtractValue(ev, fixpt);
   } else if (InsertValueInst *iv = dyn_cast<InsertValueInst>(val)) {
     res = convertInsertValue(iv, fixpt);
+  } else if (ExtractElementInst *exe = dyn_cast<ExtractElementInst>(val)) {
+    res = convertExtractElement(exe, fixpt);
+  } else if (InsertElementInst *ine = dyn_cast<InsertElementInst>(val)) {
+    res = convertInsertElement(ine, fixpt);
+  } else if (ShuffleVectorInst *shuf = dyn_cast<ShuffleVectorInst>(val)) {
+    res = convertShuffleVector(shuf, fixpt);
   } else if (PHINode *phi = dyn_cast<PHINode>(val)) {
     res = convertPhi(phi, fixpt);
   } else if (SelectInst *select = dyn_cast<SelectInst>(val)) {
@@ -50,7 +69,9 @@ Value *FloatToFixed::convertInstruction(Module& m, Instruction *val, FixedPointT
   } else if (ReturnInst *ret = dyn_cast<ReturnInst>(val)) {
     res = convertRet(ret, fixpt);
   } else if (Instruction *instr = dyn_cast<Instruction>(val)) { //llvm/include/llvm/IR/Instruction.def for more info
-    if (instr->isBinaryOp()) {
+    if (UnaryOperator *unop = dyn_cast<UnaryOperator>(instr)) {
+      res = convertUnaryOp(unop, fixpt);
+    } else if (instr->isBinaryOp()) {
       res = convertBinOp(instr, fixpt);
     } else if (CastInst *cast = dyn_cast<CastInst>(instr)){
       res = convertCast(cast, fixpt);
@@ -113,7 +134,7 @@ Value *FloatToFixed::convertAlloca(AllocaInst *alloca, const FixedPointType& fix
 Value *FloatToFixed::convertLoad(LoadInst *load, FixedPointType& fixpt)
 {
   Value *ptr = load->getPointerOperand();
-  Value *newptr = operandPool[ptr];
+  Value *newptr = convertedValue(ptr);
   if (newptr == ConversionError)
     return nullptr;
   if (!newptr)
@@ -127,7 +148,7 @@ Value *FloatToFixed::convertLoad(LoadInst *load, FixedPointType& fixpt)
       alignment, load->getOrdering(), load->getSyncScopeID());
     newinst->insertAfter(load);
     if (valueInfo(load)->noTypeConversion) {
-      assert(newinst->getType()->isIntegerTy() && "DTA bug; improperly tagged struct/pointer!");
+      assert(newinst->getType()->isIntOrIntVectorTy() && "DTA bug; improperly tagged struct/pointer!");
       return genConvertFixToFloat(newinst, fixPType(newptr), load->getType());
     }
     return newinst;
@@ -181,7 +202,7 @@ Value *FloatToFixed::convertStore(StoreInst *store)
       FixedPointType valtype = fixPType(newptr);
       
       /* the value to store is not converted but the pointer is */
-      if (peltype->isIntegerTy()) {
+      if (peltype->isIntOrIntVectorTy()) {
         /* value is not a pointer; we can convert it to fixed point */
         newval = genConvertFloatToFix(val, valtype);
       } else {
@@ -288,9 +309,257 @@ Value *FloatToFixed::convertInsertValue(InsertValueInst *inv, FixedPointType& fi
 }
 
 
+Value *FloatToFixed::convertExtractElement(ExtractElementInst *exe, FixedPointType& fixpt)
+{
+  if (valueInfo(exe)->noTypeConversion)
+    return Unsupported;
+  
+  Value *oldvec = exe->getVectorOperand();
+  FixedPointType vecfixpt = fixpt;
+  Value *newvec = translateOrMatchOperand(oldvec, vecfixpt, exe);
+  if (!newvec)
+    return nullptr;
+  
+  IRBuilder<> builder(exe);
+  Value *newi = builder.CreateExtractElement(newvec, exe->getIndexOperand());
+  return genConvertFixedToFixed(newi, vecfixpt, fixpt, exe);
+}
+
+
+Value *FloatToFixed::convertInsertElement(InsertElementInst *ine, FixedPointType& fixpt)
+{
+  if (!isFloatingPointToConvert(ine))
+    return Unsupported;
+  
+  Value *newvec = translateOrMatchOperandAndType(ine->getOperand(0), fixpt, ine);
+  Value *newelt = translateOrMatchOperandAndType(ine->getOperand(1), fixpt, ine);
+  if (!newvec || !newelt)
+    return nullptr;
+  
+  IRBuilder<> builder(ine);
+  return builder.CreateInsertElement(newvec, newelt, ine->getOperand(2));
+}
+
+
+Value *FloatToFixed::convertShuffleVector(ShuffleVectorInst *shuf, FixedPointType& fixpt)
+{
+  if (!isFloatingPointToConvert(shuf))
+    return Unsupported;
+  
+  Value *newv1 = translateOrMatchOperandAndType(shuf->getOperand(0), fixpt, shuf);
+  Value *newv2 = translateOrMatchOperandAndType(shuf->getOperand(1), fixpt, shuf);
+  if (!newv1 || !newv2)
+    return nullptr;
+  
+  IRBuilder<> builder(shuf);
+  return builder.CreateShuffleVector(newv1, newv2, shuf->getMask());
+}
+
+
+Value *FloatToFixed::convertMaskedLoad(IntrinsicInst *load, FixedPointType& fixpt)
+{
+  /* llvm.masked.load(ptr, alignment, mask, passthru) */
+  Value *ptr = load->getArgOperand(0);
+  Value *newptr = convertedValue(ptr);
+  if (newptr == ConversionError)
+    return nullptr;
+  if (!newptr || !isConvertedFixedPoint(newptr))
+    return Unsupported;
+  
+  FixedPointType ptrfixpt = fixPType(newptr);
+  Value *passthru = translateOrMatchOperandAndType(load->getArgOperand(3), ptrfixpt, load);
+  if (!passthru)
+    return nullptr;
+  
+  Type *newt = newptr->getType()->getPointerElementType();
+  Function *maskedLoad = Intrinsic::getDeclaration(load->getModule(), Intrinsic::masked_load,
+    {newt, newptr->getType()});
+  CallInst *newinst = CallInst::Create(maskedLoad,
+    {newptr, load->getArgOperand(1), load->getArgOperand(2), passthru});
+  newinst->insertAfter(load);
+  
+  fixpt = ptrfixpt;
+  if (valueInfo(load)->noTypeConversion)
+    return genConvertFixToFloat(newinst, ptrfixpt, load->getType());
+  return newinst;
+}
+
+
+Value *FloatToFixed::convertMaskedStore(IntrinsicInst *store)
+{
+  /* llvm.masked.store(value, ptr, alignment, mask) */
+  Value *ptr = store->getArgOperand(1);
+  Value *newptr = matchOp(ptr);
+  if (!newptr)
+    return nullptr;
+  if (!isConvertedFixedPoint(newptr))
+    return Unsupported;
+  
+  Value *newval = translateOrMatchOperandAndType(store->getArgOperand(0), fixPType(newptr), store);
+  if (!newval)
+    return nullptr;
+  
+  Function *maskedStore = Intrinsic::getDeclaration(store->getModule(), Intrinsic::masked_store,
+    {newval->getType(), newptr->getType()});
+  CallInst *newinst = CallInst::Create(maskedStore,
+    {newval, newptr, store->getArgOperand(2), store->getArgOperand(3)});
+  newinst->insertAfter(store);
+  return newinst;
+}
+
+
+Value *FloatToFixed::genFixedPointNeg(Value *val, const FixedPointType& fixpt, Instruction *ip, bool saturate)
+{
+  IRBuilder<> builder(ip);
+  Value *zero = Constant::getNullValue(val->getType());
+  if (saturate)
+    return builder.CreateBinaryIntrinsic(
+      fixpt.scalarIsSigned() ? Intrinsic::ssub_sat : Intrinsic::usub_sat, zero, val);
+  return builder.CreateSub(zero, val);
+}
+
+
+Value *FloatToFixed::genFixedPointAbs(Value *val, const FixedPointType& fixpt, Instruction *ip, bool saturate)
+{
+  if (!fixpt.scalarIsSigned())
+    return val;
+  Value *neg = genFixedPointNeg(val, fixpt, ip, saturate);
+  IRBuilder<> builder(ip);
+  Value *isneg = builder.CreateICmpSLT(val, Constant::getNullValue(val->getType()));
+  return builder.CreateSelect(isneg, neg, val);
+}
+
+
+Value *FloatToFixed::convertFloatIntrinsic(IntrinsicInst *intr, FixedPointType& fixpt)
+{
+  Intrinsic::ID id = intr->getIntrinsicID();
+  switch (id) {
+    case Intrinsic::fabs:
+    case Intrinsic::fma:
+    case Intrinsic::fmuladd:
+    case Intrinsic::minnum:
+    case Intrinsic::maxnum:
+    case Intrinsic::copysign:
+    case Intrinsic::floor:
+    case Intrinsic::ceil:
+    case Intrinsic::trunc:
+    case Intrinsic::round:
+      break;
+    default:
+      return Unsupported;
+  }
+  if (!intr->getType()->isFPOrFPVectorTy() || !hasInfo(intr) || valueInfo(intr)->noTypeConversion)
+    return Unsupported;
+  
+  bool saturate = isSaturating(intr);
+  Value *res;
+  
+  if (id == Intrinsic::fma || id == Intrinsic::fmuladd) {
+    /* a * b + c, with the addition performed at the width of the product */
+    FixedPointType intype1 = fixpt, intype2 = fixpt, intype3 = fixpt;
+    Value *val1 = translateOrMatchOperand(intr->getArgOperand(0), intype1, intr, TypeMatchPolicy::RangeOverHintMaxInt);
+    Value *val2 = translateOrMatchOperand(intr->getArgOperand(1), intype2, intr, TypeMatchPolicy::RangeOverHintMaxInt);
+    Value *val3 = translateOrMatchOperand(intr->getArgOperand(2), intype3, intr, TypeMatchPolicy::RangeOverHintMaxFrac);
+    if (!val1 || !val2 || !val3)
+      return nullptr;
+    FixedPointType intermtype;
+    Value *prod = genWideFixedPointMul(intr, val1, intype1, val2, intype2, fixpt.scalarIsSigned(), intermtype);
+    Value *addend = genConvertFixedToFixed(val3, intype3, intermtype, intr);
+    IRBuilder<> builder(intr);
+    Value *sum;
+    if (saturate)
+      sum = builder.CreateBinaryIntrinsic(
+        intermtype.scalarIsSigned() ? Intrinsic::sadd_sat : Intrinsic::uadd_sat, prod, addend);
+    else
+      sum = builder.CreateAdd(prod, addend);
+    cpMetaData(sum, intr);
+    updateFPTypeMetadata(sum, intermtype.scalarIsSigned(), intermtype.scalarFracBitsAmt(), intermtype.scalarBitsAmt());
+    return genConvertFixedToFixed(sum, intermtype, fixpt, intr);
+  }
+  
+  Value *val = translateOrMatchOperandAndType(intr->getArgOperand(0), fixpt, intr);
+  if (!val)
+    return nullptr;
+  IRBuilder<> builder(intr);
+  Type *ty = val->getType();
+  bool sign = fixpt.scalarIsSigned();
+  int frac = fixpt.scalarFracBitsAmt();
+  unsigned bits = ty->getScalarSizeInBits();
+  
+  if (id == Intrinsic::fabs) {
+    res = genFixedPointAbs(val, fixpt, intr, saturate);
+    
+  } else if (id == Intrinsic::minnum || id == Intrinsic::maxnum) {
+    Value *val2 = translateOrMatchOperandAndType(intr->getArgOperand(1), fixpt, intr);
+    if (!val2)
+      return nullptr;
+    Value *lt = sign ? builder.CreateICmpSLT(val, val2) : builder.CreateICmpULT(val, val2);
+    if (id == Intrinsic::minnum)
+      res = builder.CreateSelect(lt, val, val2);
+    else
+      res = builder.CreateSelect(lt, val2, val);
+    
+  } else if (id == Intrinsic::copysign) {
+    /* only the sign of the second operand matters; keep its own format */
+    FixedPointType signtype = fixpt;
+    Value *signval = translateOrMatchOperand(intr->getArgOperand(1), signtype, intr, TypeMatchPolicy::RangeOverHintMaxInt);
+    if (!signval)
+      return nullptr;
+    Value *abs = genFixedPointAbs(val, fixpt, intr, saturate);
+    if (!sign || !signtype.scalarIsSigned()) {
+      res = abs;
+    } else {
+      Value *isneg = builder.CreateICmpSLT(signval, Constant::getNullValue(signval->getType()));
+      res = builder.CreateSelect(isneg, genFixedPointNeg(abs, fixpt, intr, saturate), abs);
+    }
+    
+  } else /* floor, ceil, trunc, round */ {
+    if (frac <= 0)
+      return val;
+    /* clear the fractional bits after the appropriate bias */
+    Constant *mask = ConstantInt::get(ty, APInt::getHighBitsSet(bits, bits - std::min<unsigned>(frac, bits)));
+    auto genMaskedAdd = [&](const APInt& bias) -> Value* {
+      Value *biased = val;
+      if (!bias.isNullValue()) {
+        Constant *biasc = ConstantInt::get(ty, bias);
+        if (saturate)
+          biased = builder.CreateBinaryIntrinsic(sign ? Intrinsic::sadd_sat : Intrinsic::uadd_sat, val, biasc);
+        else
+          biased = builder.CreateAdd(val, biasc);
+      }
+      return builder.CreateAnd(biased, mask);
+    };
+    APInt ulpmask = APInt::getLowBitsSet(bits, std::min<unsigned>(frac, bits));
+    APInt half = APInt::getOneBitSet(bits, std::min<unsigned>(frac, bits) - 1);
+    
+    if (id == Intrinsic::floor) {
+      res = genMaskedAdd(APInt(bits, 0));
+    } else if (id == Intrinsic::ceil) {
+      res = genMaskedAdd(ulpmask);
+    } else if (id == Intrinsic::trunc) {
+      res = genMaskedAdd(APInt(bits, 0));
+      if (sign) {
+        Value *isneg = builder.CreateICmpSLT(val, Constant::getNullValue(ty));
+        res = builder.CreateSelect(isneg, genMaskedAdd(ulpmask), res);
+      }
+    } else /* if (id == Intrinsic::round) */ {
+      /* halfway cases are rounded away from zero */
+      res = genMaskedAdd(half);
+      if (sign) {
+        Value *isneg = builder.CreateICmpSLT(val, Constant::getNullValue(ty));
+        res = builder.CreateSelect(isneg, genMaskedAdd(half - 1), res);
+      }
+    }
+  }
+  
+  cpMetaData(res, intr);
+  return res;
+}
+
+
 Value *FloatToFixed::convertPhi(PHINode *phi, FixedPointType& fixpt)
 {
-  if (!phi->getType()->isFloatingPointTy() || valueInfo(phi)->noTypeConversion) {
+  if (!phi->getType()->isFPOrFPVectorTy() || valueInfo(phi)->noTypeConversion) {
     /* in the conversion chain the floating point number was converted to
      * an int at some point; we just upgrade the incoming values in place */
 
@@ -313,7 +582,7 @@ Value *FloatToFixed::convertPhi(PHINode *phi, FixedPointType& fixpt)
   /* if we have to do a type change, create a new phi node. The new type is for
    * sure that of a fixed point value; because the original type was a float
    * and thus all of its incoming values were floats */
-  PHINode *newphi = PHINode::Create(fixpt.scalarToLLVMType(phi->getContext()),
+  PHINode *newphi = PHINode::Create(getLLVMFixedPointTypeForFloatType(phi->getType(), fixpt),
     phi->getNumIncomingValues());
 
   for (int i=0; i<phi->getNumIncomingValues(); i++) {
@@ -361,10 +630,21 @@ Value *FloatToFixed::convertCall(CallSite *call, FixedPointType& fixpt)
    * otherwise the return type is left unchanged.*/
   Function *oldF = call->getCalledFunction();
 
+  if (IntrinsicInst *intr = dyn_cast<IntrinsicInst>(call->getInstruction())) {
+    if (intr->getIntrinsicID() == Intrinsic::masked_load)
+      return convertMaskedLoad(intr, fixpt);
+    if (intr->getIntrinsicID() == Intrinsic::masked_store)
+      return convertMaskedStore(intr);
+    Value *res = convertFloatIntrinsic(intr, fixpt);
+    if (res != Unsupported)
+      return res;
+  }
+  if (isMathRuntimeCall(call))
+    return convertMathCall(call, fixpt);
   if (isSpecialFunction(oldF))
     return Unsupported;
   
-  Function *newF = functionPool[oldF];
+  Function *newF = callTargets.lookup(call->getInstruction());
   if (!newF) {
     LLVM_DEBUG(dbgs() << "[Info] no function clone for instruction" << *(call->getInstruction()) << ", engaging fallback\n");
     return Unsupported;
@@ -474,12 +754,63 @@ Value *FloatToFixed::convertRet(ReturnInst *ret, FixedPointType& fixpt)
 }
 
 
+Value *FloatToFixed::convertUnaryOp(UnaryOperator *instr, const FixedPointType& fixpt)
+{
+  if (instr->getOpcode() != Instruction::FNeg)
+    return Unsupported;
+  if (!instr->getType()->isFPOrFPVectorTy() || valueInfo(instr)->noTypeConversion)
+    return Unsupported;
+  
+  Value *val = translateOrMatchOperandAndType(instr->getOperand(0), fixpt, instr);
+  if (!val)
+    return nullptr;
+  Value *fixop = genFixedPointNeg(val, fixpt, instr, isSaturating(instr));
+  cpMetaData(fixop, instr);
+  return fixop;
+}
+
+
+/** Returns the floating point constant splatted in all the lanes of a
+ *  vector constant, or the constant itself if it is a scalar. */
+static ConstantFP *getSplatConstantFP(Value *v)
+{
+  if (ConstantFP *cfp = dyn_cast<ConstantFP>(v))
+    return cfp;
+  if (Constant *c = dyn_cast<Constant>(v))
+    if (c->getType()->isVectorTy())
+      return dyn_cast_or_null<ConstantFP>(c->getSplatValue());
+  return nullptr;
+}
+
+
+/** Checks if a value is a positive power of two floating point constant
+ *  (or a splat vector of such a constant).
+ *  @param exp Set to the base 2 logarithm of the constant.
+ *  @returns true if the value is a power of two. */
+static bool getPowerOf2Exponent(Value *v, int& exp)
+{
+  ConstantFP *cfp = getSplatConstantFP(v);
+  if (!cfp)
+    return false;
+  const APFloat& c = cfp->getValueAPF();
+  if (!c.isFiniteNonZero() || c.isNegative())
+    return false;
+  
+  int e = ilogb(c);
+  APFloat pow2 = scalbn(APFloat(c.getSemantics(), 1), e, APFloat::rmNearestTiesToEven);
+  if (!pow2.bitwiseIsEqual(c))
+    return false;
+  exp = e;
+  return true;
+}
+
+
 Value *FloatToFixed::convertBinOp(Instruction *instr, const FixedPointType& fixpt)
 {
   /*le istruzioni Instruction::
     [Add,Sub,Mul,SDiv,UDiv,SRem,URem,Shl,LShr,AShr,And,Or,Xor]
     vengono gestite dalla fallback e non in questa funzione */
-  if (!instr->getType()->isFloatingPointTy() || valueInfo(instr)->noTypeConversion)
+  if (!instr->getType()->isFPOrFPVectorTy() || valueInfo(instr)->noTypeConversion)
     return Unsupported;
   
   int opc = instr->getOpcode();
@@ -491,13 +822,22 @@ Value *FloatToFixed::convertBinOp(Instruction *instr, const FixedPointType& fixp
       return nullptr;
     IRBuilder<> builder(instr);
     Value *fixop;
+    bool saturate = isSaturating(instr);
     
     if (opc == Instruction::FAdd) {
-      fixop = builder.CreateBinOp(Instruction::Add, val1, val2);
+      if (saturate)
+        fixop = builder.CreateBinaryIntrinsic(
+          fixpt.scalarIsSigned() ? Intrinsic::sadd_sat : Intrinsic::uadd_sat, val1, val2);
+      else
+        fixop = builder.CreateBinOp(Instruction::Add, val1, val2);
     
     } else if (opc == Instruction::FSub) {
       // TODO: improve overflow resistance by shifting late
-      fixop = builder.CreateBinOp(Instruction::Sub, val1, val2);
+      if (saturate)
+        fixop = builder.CreateBinaryIntrinsic(
+          fixpt.scalarIsSigned() ? Intrinsic::ssub_sat : Intrinsic::usub_sat, val1, val2);
+      else
+        fixop = builder.CreateBinOp(Instruction::Sub, val1, val2);
     
     } else /* if (opc == Instruction::FRem) */ {
       if (fixpt.scalarIsSigned())
@@ -512,41 +852,62 @@ Value *FloatToFixed::convertBinOp(Instruction *instr, const FixedPointType& fixp
     return fixop;
 
   } else if (opc == Instruction::FMul) {
+    int exp;
+    if (getPowerOf2Exponent(instr->getOperand(1), exp)) {
+      if (Value *res = genFixedPointScaleByPowerOf2(instr, instr->getOperand(0), exp, fixpt))
+        return res;
+    } else if (getPowerOf2Exponent(instr->getOperand(0), exp)) {
+      if (Value *res = genFixedPointScaleByPowerOf2(instr, instr->getOperand(1), exp, fixpt))
+        return res;
+    }
+    
     FixedPointType intype1 = fixpt, intype2 = fixpt;
     Value *val1 = translateOrMatchOperand(instr->getOperand(0), intype1, instr, TypeMatchPolicy::RangeOverHintMaxInt);
     Value *val2 = translateOrMatchOperand(instr->getOperand(1), intype2, instr, TypeMatchPolicy::RangeOverHintMaxInt);
     if (!val1 || !val2)
       return nullptr;
-    FixedPointType intermtype(
-      fixpt.scalarIsSigned(),
-      intype1.scalarFracBitsAmt() + intype2.scalarFracBitsAmt(),
-      intype1.scalarBitsAmt() + intype2.scalarBitsAmt());
-    Type *dbfxt = intermtype.scalarToLLVMType(instr->getContext());
-    
-    IRBuilder<> builder(instr);
-    Value *ext1 = intype1.scalarIsSigned() ? builder.CreateSExt(val1, dbfxt) : builder.CreateZExt(val1, dbfxt);
-    Value *ext2 = intype2.scalarIsSigned() ? builder.CreateSExt(val2, dbfxt) : builder.CreateZExt(val2, dbfxt);
-    Value *fixop = builder.CreateMul(ext1, ext2);
-    cpMetaData(ext1,val1);
-    cpMetaData(ext2,val2);
-    cpMetaData(fixop,instr);
-    updateFPTypeMetadata(fixop, intermtype.scalarIsSigned(), intermtype.scalarFracBitsAmt(), intermtype.scalarBitsAmt());
-    updateConstTypeMetadata(fixop, 0U, intype1);
-    updateConstTypeMetadata(fixop, 1U, intype2);
-    return genConvertFixedToFixed(fixop, intermtype, fixpt, instr);
+    bool saturate = isSaturating(instr);
+    if (UseFixedPointIntrinsics || saturate) {
+      if (Value *fixop = genFixedPointIntrinsic(instr, val1, intype1, val2, intype2, fixpt, saturate))
+        return fixop;
+    }
+    return genFixedPointMul(instr, val1, intype1, val2, intype2, fixpt);
     
   } else if (opc == Instruction::FDiv) {
+    int exp;
+    if (getPowerOf2Exponent(instr->getOperand(1), exp)) {
+      if (Value *res = genFixedPointScaleByPowerOf2(instr, instr->getOperand(0), -exp, fixpt))
+        return res;
+    }
+    
+    if (UseReciprocalForConstantDivisor) {
+      FixedPointType intype2;
+      if (Constant *val2 = getConstantReciprocal(instr->getOperand(1), fixpt, intype2)) {
+        /* x / c -> x * (1 / c) */
+        FixedPointType intype1 = fixpt;
+        Value *val1 = translateOrMatchOperand(instr->getOperand(0), intype1, instr, TypeMatchPolicy::RangeOverHintMaxInt);
+        if (!val1)
+          return nullptr;
+        return genFixedPointMul(instr, val1, intype1, val2, intype2, fixpt);
+      }
+    }
+    
     // TODO: fix by using HintOverRange when it is actually implemented
     FixedPointType intype1 = fixpt, intype2 = fixpt;
     Value *val1 = translateOrMatchOperand(instr->getOperand(0), intype1, instr, TypeMatchPolicy::RangeOverHintMaxFrac);
     Value *val2 = translateOrMatchOperand(instr->getOperand(1), intype2, instr, TypeMatchPolicy::RangeOverHintMaxInt);
     if (!val1 || !val2)
       return nullptr;
+    bool saturate = isSaturating(instr);
+    if (UseFixedPointIntrinsics || saturate) {
+      if (Value *fixop = genFixedPointIntrinsic(instr, val1, intype1, val2, intype2, fixpt, saturate))
+        return fixop;
+    }
     FixedPointType intermtype(
       fixpt.scalarIsSigned(),
       intype1.scalarFracBitsAmt() + intype2.scalarFracBitsAmt(),
       intype1.scalarBitsAmt() + intype2.scalarBitsAmt());
-    Type *dbfxt = intermtype.scalarToLLVMType(instr->getContext());
+    Type *dbfxt = getLLVMFixedPointTypeForFloatType(instr->getType(), intermtype);
     
     FixedPointType fixoptype(
       fixpt.scalarIsSigned(),
@@ -569,12 +930,292 @@ Value *FloatToFixed::convertBinOp(Instruction *instr, const FixedPointType& fixp
 }
 
 
+Value *FloatToFixed::genFixedPointMul(Instruction *instr, Value *val1, const FixedPointType& intype1,
+  Value *val2, const FixedPointType& intype2, const FixedPointType& fixpt)
+{
+  FixedPointType intermtype;
+  Value *fixop = genWideFixedPointMul(instr, val1, intype1, val2, intype2, fixpt.scalarIsSigned(), intermtype);
+  return genConvertFixedToFixed(fixop, intermtype, fixpt, instr);
+}
+
+
+Value *FloatToFixed::genWideFixedPointMul(Instruction *instr, Value *val1, const FixedPointType& intype1,
+  Value *val2, const FixedPointType& intype2, bool sign, FixedPointType& intermtype)
+{
+  intermtype = FixedPointType(
+    sign,
+    intype1.scalarFracBitsAmt() + intype2.scalarFracBitsAmt(),
+    intype1.scalarBitsAmt() + intype2.scalarBitsAmt());
+  Type *dbfxt = getLLVMFixedPointTypeForFloatType(instr->getType(), intermtype);
+  
+  IRBuilder<> builder(instr);
+  Value *ext1 = intype1.scalarIsSigned() ? builder.CreateSExt(val1, dbfxt) : builder.CreateZExt(val1, dbfxt);
+  Value *ext2 = intype2.scalarIsSigned() ? builder.CreateSExt(val2, dbfxt) : builder.CreateZExt(val2, dbfxt);
+  Value *fixop = builder.CreateMul(ext1, ext2);
+  cpMetaData(ext1,val1);
+  cpMetaData(ext2,val2);
+  cpMetaData(fixop,instr);
+  updateFPTypeMetadata(fixop, intermtype.scalarIsSigned(), intermtype.scalarFracBitsAmt(), intermtype.scalarBitsAmt());
+  updateConstTypeMetadata(fixop, 0U, intype1);
+  updateConstTypeMetadata(fixop, 1U, intype2);
+  return fixop;
+}
+
+
+Value *FloatToFixed::genFixedPointScaleByPowerOf2(Instruction *instr, Value *op, int exp, const FixedPointType& fixpt)
+{
+  FixedPointType intype = fixpt;
+  Value *val = translateOrMatchOperand(op, intype, instr, TypeMatchPolicy::RangeOverHintMaxFrac);
+  if (!val)
+    return nullptr;
+  
+  /* The result may consist of the same bits of the converted operand (or
+   * of another conversion of it) in a different format. A value has only
+   * one format, thus reinterpretations get a value of their own. */
+  Value *opval = val;
+  auto genReinterpret = [&](Value *v) -> Value* {
+    Instruction *noop = new BitCastInst(v, v->getType(), "", instr);
+    cpMetaData(noop, instr);
+    updateFPTypeMetadata(noop, fixpt.scalarIsSigned(), fixpt.scalarFracBitsAmt(), fixpt.scalarBitsAmt());
+    return noop;
+  };
+  
+  /* Multiplying by 2^exp only moves the binary point: the same bits
+   * represent the result with exp less fractional bits. */
+  bool sign = intype.scalarIsSigned();
+  int bits = intype.scalarBitsAmt();
+  int frac = intype.scalarFracBitsAmt() - exp;
+  if (frac < 0 || frac > bits) {
+    /* Equivalently, convert op to a format with exp more fractional bits
+     * than fixpt and reinterpret the result as fixpt. */
+    int destfrac = fixpt.scalarFracBitsAmt() + exp;
+    if (destfrac >= 0 && destfrac <= fixpt.scalarBitsAmt()) {
+      FixedPointType scaledtype(fixpt.scalarIsSigned(), destfrac, fixpt.scalarBitsAmt());
+      return genReinterpret(genConvertFixedToFixed(val, intype, scaledtype, instr));
+    }
+    
+    /* The new position of the binary point is outside of the value;
+     * shift it back to the nearest allowed format, unless it is so far
+     * that the shift does not fit in the value. */
+    int newfrac = frac < 0 ? 0 : bits;
+    if (std::abs(frac - newfrac) >= bits)
+      return nullptr;
+    IRBuilder<> builder(instr);
+    Constant *shamt = ConstantInt::get(val->getType(), std::abs(frac - newfrac));
+    if (frac < 0)
+      val = builder.CreateShl(val, shamt);
+    else
+      val = sign ? builder.CreateAShr(val, shamt) : builder.CreateLShr(val, shamt);
+    cpMetaData(val, instr);
+    frac = newfrac;
+    updateFPTypeMetadata(val, sign, frac, bits);
+  }
+  
+  FixedPointType scaledtype(sign, frac, bits);
+  Value *res = genConvertFixedToFixed(val, scaledtype, fixpt, instr);
+  if (res == opval)
+    return genReinterpret(res);
+  return res;
+}
+
+
+Constant *FloatToFixed::getConstantReciprocal(Value *divisor, const FixedPointType& fixpt, FixedPointType& recipt)
+{
+  ConstantFP *cfp = getSplatConstantFP(divisor);
+  if (!cfp)
+    return nullptr;
+  const APFloat& d = cfp->getValueAPF();
+  if (!d.isFiniteNonZero())
+    return nullptr;
+  
+  /* d = m / 2^k exactly, with m an integer of at most precision bits */
+  int e = ilogb(d);
+  int k = (int)APFloat::semanticsPrecision(d.getSemantics()) - 1 - e;
+  APSInt m(APFloat::semanticsPrecision(d.getSemantics()) + 1, false);
+  bool exact;
+  APFloat scaled = scalbn(d, k, APFloat::rmNearestTiesToEven);
+  scaled.clearSign();
+  if (scaled.convertToInteger(m, APFloat::rmTowardZero, &exact) != APFloat::opOK || !exact)
+    return nullptr;
+  
+  /* 2^-(e+1) < |1/d| <= 2^-e, thus with frac = magnitude bits - 1 + e the
+   * rounded reciprocal always fits and has at least as many significant
+   * bits as the magnitude of the type minus one */
+  bool sign = fixpt.scalarIsSigned() || d.isNegative();
+  int bits = fixpt.scalarBitsAmt();
+  int frac = std::min(bits - (sign ? 1 : 0) - 1 + e, bits);
+  if (frac < 0 || k + frac < 0 || k + frac > 2048)
+    return nullptr;
+  
+  /* round(2^(k+frac) / m), computed exactly */
+  unsigned w = std::max((unsigned)(k + frac + 2), m.getBitWidth() + 1);
+  APInt mw = m.zext(w);
+  APInt r = (APInt::getOneBitSet(w, k + frac) + mw.lshr(1)).udiv(mw);
+  r = r.zextOrTrunc(bits);
+  if (d.isNegative())
+    r = -r;
+  
+  recipt = FixedPointType(sign, frac, bits);
+  return ConstantInt::get(getLLVMFixedPointTypeForFloatType(divisor->getType(), recipt), r);
+}
+
+
+Value *FloatToFixed::genFixedPointIntrinsic(Instruction *instr, Value *val1, const FixedPointType& intype1,
+  Value *val2, const FixedPointType& intype2, const FixedPointType& fixpt, bool saturate)
+{
+  /* the intrinsics require both operands and the result to have the same
+   * width and signedness */
+  int bits = fixpt.scalarBitsAmt();
+  bool sign = fixpt.scalarIsSigned();
+  if (intype1.scalarBitsAmt() != bits || intype2.scalarBitsAmt() != bits)
+    return nullptr;
+  if (intype1.scalarIsSigned() != sign || intype2.scalarIsSigned() != sign)
+    return nullptr;
+  
+  int scale;
+  Intrinsic::ID iid;
+  if (instr->getOpcode() == Instruction::FMul) {
+    /* (a * b) >> scale */
+    scale = intype1.scalarFracBitsAmt() + intype2.scalarFracBitsAmt() - fixpt.scalarFracBitsAmt();
+    if (saturate)
+      iid = sign ? Intrinsic::smul_fix_sat : Intrinsic::umul_fix_sat;
+    else
+      iid = sign ? Intrinsic::smul_fix : Intrinsic::umul_fix;
+  } else {
+    /* there are no saturating division intrinsics; the generic division
+     * saturates when narrowing the result to the destination format */
+    if (saturate)
+      return nullptr;
+    /* (a << scale) / b */
+    scale = fixpt.scalarFracBitsAmt() + intype2.scalarFracBitsAmt() - intype1.scalarFracBitsAmt();
+    iid = sign ? Intrinsic::sdiv_fix : Intrinsic::udiv_fix;
+  }
+  if (scale < 0 || scale >= bits)
+    return nullptr;
+  
+  IRBuilder<> builder(instr);
+  Value *fixop = builder.CreateIntrinsic(iid, {val1->getType()}, {val1, val2, builder.getInt32(scale)});
+  cpMetaData(fixop,instr);
+  updateFPTypeMetadata(fixop, sign, fixpt.scalarFracBitsAmt(), bits);
+  updateConstTypeMetadata(fixop, 0U, intype1);
+  updateConstTypeMetadata(fixop, 1U, intype2);
+  return fixop;
+}
+
+
+Value *FloatToFixed::convertCmpWithConstant(FCmpInst *fcmp)
+{
+  Value *op = fcmp->getOperand(0);
+  ConstantFP *c = getSplatConstantFP(fcmp->getOperand(1));
+  CmpInst::Predicate pr = fcmp->getPredicate();
+  if (!c) {
+    c = getSplatConstantFP(op);
+    op = fcmp->getOperand(1);
+    pr = CmpInst::getSwappedPredicate(pr);
+  }
+  if (!c || isa<Constant>(op) || !hasInfo(op) || c->getValueAPF().isNaN())
+    return nullptr;
+  
+  /* fixed point values are never NaN, therefore ordered and unordered
+   * predicates are equivalent */
+  switch (pr) {
+    case CmpInst::FCMP_UEQ: pr = CmpInst::FCMP_OEQ; break;
+    case CmpInst::FCMP_UNE: pr = CmpInst::FCMP_ONE; break;
+    case CmpInst::FCMP_UGT: pr = CmpInst::FCMP_OGT; break;
+    case CmpInst::FCMP_UGE: pr = CmpInst::FCMP_OGE; break;
+    case CmpInst::FCMP_ULT: pr = CmpInst::FCMP_OLT; break;
+    case CmpInst::FCMP_ULE: pr = CmpInst::FCMP_OLE; break;
+    case CmpInst::FCMP_OEQ: case CmpInst::FCMP_ONE: case CmpInst::FCMP_OGT:
+    case CmpInst::FCMP_OGE: case CmpInst::FCMP_OLT: case CmpInst::FCMP_OLE:
+      break;
+    default:
+      return nullptr;
+  }
+  
+  FixedPointType fixpt = fixPType(op);
+  Value *val = translateOrMatchOperand(op, fixpt, fcmp, TypeMatchPolicy::RangeOverHintMaxFrac);
+  if (!val)
+    return nullptr;
+  bool sign = fixpt.scalarIsSigned();
+  unsigned bits = fixpt.scalarBitsAmt();
+  
+  /* Rescale the constant to the format of the other operand, rounding
+   * towards negative infinity; the width is large enough to tell values
+   * just out of the range of the format */
+  unsigned w = bits + 2;
+  APFloat scaled = scalbn(c->getValueAPF(), fixpt.scalarFracBitsAmt(), APFloat::rmNearestTiesToEven);
+  APSInt k(w, false);
+  bool exact;
+  APFloat::opStatus status = scaled.convertToInteger(k, APFloat::rmTowardNegative, &exact);
+  bool below, above;
+  if (status & APFloat::opInvalidOp) {
+    below = scaled.isNegative();
+    above = !below;
+  } else {
+    APInt min = sign ? APInt::getSignedMinValue(bits).sext(w) : APInt(w, 0);
+    APInt max = sign ? APInt::getSignedMaxValue(bits).sext(w) : APInt::getMaxValue(bits).zext(w);
+    below = k.slt(min);
+    above = k.sgt(max);
+  }
+  
+  if (below || above) {
+    bool res;
+    if (pr == CmpInst::FCMP_OEQ)
+      res = false;
+    else if (pr == CmpInst::FCMP_ONE)
+      res = true;
+    else
+      res = below == (pr == CmpInst::FCMP_OGT || pr == CmpInst::FCMP_OGE);
+    return ConstantInt::get(fcmp->getType(), res);
+  }
+  
+  Constant *kc = ConstantInt::get(val->getType(), k.trunc(bits));
+  IRBuilder<> builder(fcmp->getNextNode());
+  switch (pr) {
+    case CmpInst::FCMP_OEQ:
+      return exact ? builder.CreateICmpEQ(val, kc) : ConstantInt::getFalse(fcmp->getType());
+    case CmpInst::FCMP_ONE:
+      return exact ? builder.CreateICmpNE(val, kc) : ConstantInt::getTrue(fcmp->getType());
+    case CmpInst::FCMP_OLT:
+      if (exact)
+        return sign ? builder.CreateICmpSLT(val, kc) : builder.CreateICmpULT(val, kc);
+      return sign ? builder.CreateICmpSLE(val, kc) : builder.CreateICmpULE(val, kc);
+    case CmpInst::FCMP_OLE:
+      return sign ? builder.CreateICmpSLE(val, kc) : builder.CreateICmpULE(val, kc);
+    case CmpInst::FCMP_OGT:
+      return sign ? builder.CreateICmpSGT(val, kc) : builder.CreateICmpUGT(val, kc);
+    default: /* CmpInst::FCMP_OGE */
+      if (exact)
+        return sign ? builder.CreateICmpSGE(val, kc) : builder.CreateICmpUGE(val, kc);
+      return sign ? builder.CreateICmpSGT(val, kc) : builder.CreateICmpUGT(val, kc);
+  }
+}
+
+
+bool FloatToFixed::fitsInFixedPointType(Value *val, const FixedPointType& srct, const FixedPointType& destt)
+{
+  int srcint = srct.scalarBitsAmt() - srct.scalarFracBitsAmt() - (srct.scalarIsSigned() ? 1 : 0);
+  int destint = destt.scalarBitsAmt() - destt.scalarFracBitsAmt() - (destt.scalarIsSigned() ? 1 : 0);
+  if (srcint <= destint && (destt.scalarIsSigned() || !srct.scalarIsSigned()))
+    return true;
+  
+  mdutils::InputInfo *ii = dyn_cast_or_null<mdutils::InputInfo>(retrieveMDInfo(val));
+  if (!ii || !ii->IRange)
+    return false;
+  double limit = std::ldexp(1.0, destint);
+  double min = destt.scalarIsSigned() ? -limit : 0.0;
+  return ii->IRange->Max < limit && ii->IRange->Min >= min;
+}
+
+
 Value *FloatToFixed::convertCmp(FCmpInst *fcmp)
 {
+  if (Value *res = convertCmpWithConstant(fcmp))
+    return res;
+  
   Value *op1 = fcmp->getOperand(0);
   Value *op2 = fcmp->getOperand(1);
   
-  FixedPointType cmptype;
   FixedPointType t1, t2;
   bool hasinfo1 = hasInfo(op1), hasinfo2 = hasInfo(op2);
   if (hasinfo1 && hasinfo2) {
@@ -582,19 +1223,31 @@ Value *FloatToFixed::convertCmp(FCmpInst *fcmp)
     t2 = fixPType(op2);
   } else if (hasinfo1) {
     t1 = fixPType(op1);
-    t2 = t1;
-    t2.scalarIsSigned() = true;
+    t2 = FixedPointType(true, t1.scalarFracBitsAmt(), t1.scalarBitsAmt());
   } else if (hasinfo2) {
     t2 = fixPType(op2);
-    t1 = t2;
-    t1.scalarIsSigned() = true;
+    t1 = FixedPointType(true, t2.scalarFracBitsAmt(), t2.scalarBitsAmt());
   }
   bool mixedsign = t1.scalarIsSigned() != t2.scalarIsSigned();
   int intpart1 = t1.scalarBitsAmt() - t1.scalarFracBitsAmt() + (mixedsign ? t1.scalarIsSigned() : 0);
   int intpart2 = t2.scalarBitsAmt() - t2.scalarFracBitsAmt() + (mixedsign ? t2.scalarIsSigned() : 0);
-  cmptype.scalarIsSigned() = t1.scalarIsSigned() || t2.scalarIsSigned();
-  cmptype.scalarFracBitsAmt() = std::max(t1.scalarFracBitsAmt(), t2.scalarFracBitsAmt());
-  cmptype.scalarBitsAmt() = std::max(intpart1, intpart2) + cmptype.scalarFracBitsAmt();
+  int cmpfrac = std::max(t1.scalarFracBitsAmt(), t2.scalarFracBitsAmt());
+  FixedPointType cmptype(
+    t1.scalarIsSigned() || t2.scalarIsSigned(),
+    cmpfrac,
+    std::max(intpart1, intpart2) + cmpfrac);
+  
+  /* Compare at the width of the widest operand when the ranges of the
+   * operands allow it, by only shifting the operand with less fractional
+   * bits */
+  int nativebits = std::max(t1.scalarBitsAmt(), t2.scalarBitsAmt());
+  if (cmptype.scalarBitsAmt() > nativebits && nativebits > cmpfrac) {
+    FixedPointType narrowtype(cmptype.scalarIsSigned(), cmpfrac, nativebits);
+    if (fitsInFixedPointType(op1, t1, narrowtype) && fitsInFixedPointType(op2, t2, narrowtype)) {
+      cmptype = narrowtype;
+      NarrowComparisonCount++;
+    }
+  }
   
   Value *val1 = translateOrMatchOperandAndType(op1, cmptype, fcmp);
   Value *val2 = translateOrMatchOperandAndType(op2, cmptype, fcmp);
@@ -661,7 +1314,7 @@ Value *FloatToFixed::convertCast(CastInst *cast, const FixedPointType& fixpt)
     return Unsupported;
   
   if (BitCastInst *bc = dyn_cast<BitCastInst>(cast)) {
-    Value *newOperand = operandPool[operand];
+    Value *newOperand = convertedValue(operand);
     Type *newType = getLLVMFixedPointTypeForFloatType(bc->getDestTy(), fixpt);
     if (newOperand && newOperand!=ConversionError){
       return builder.CreateBitCast(newOperand, newType);
@@ -670,7 +1323,7 @@ Value *FloatToFixed::convertCast(CastInst *cast, const FixedPointType& fixpt)
     }
   }
   
-  if (operand->getType()->isFloatingPointTy()) {
+  if (operand->getType()->isFPOrFPVectorTy()) {
     /* fptosi, fptoui, fptrunc, fpext */
     if (cast->getOpcode() == Instruction::FPToSI) {
       return translateOrMatchOperandAndType(operand, FixedPointType(cast->getType(), true), cast);
@@ -733,7 +1386,7 @@ Value *FloatToFixed::fallback(Instruction *unsupp, FixedPointType& fixpt)
     tmp->setOperand(i, newops[i]);
   }
   LLVM_DEBUG(dbgs() << "  mutated operands to:\n" << *tmp << "\n");
-  if (tmp->getType()->isFloatingPointTy() && valueInfo(unsupp)->noTypeConversion == false) {
+  if (tmp->getType()->isFPOrFPVectorTy() && valueInfo(unsupp)->noTypeConversion == false) {
     Value *fallbackv = genConvertFloatToFix(tmp, fixpt, getFirstInsertionPointAfter(tmp));
     if (tmp->hasName())
       fallbackv->setName(tmp->getName() + ".fallback");
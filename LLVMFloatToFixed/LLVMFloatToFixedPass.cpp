@@ -6,12 +6,27 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/TimeProfiler.h"
 #include <llvm/Transforms/Utils/ValueMapper.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/FunctionComparator.h>
 #include "LLVMFloatToFixedPass.h"
 #include "TypeUtils.h"
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
 
 
 using namespace llvm;
@@ -21,6 +36,15 @@ using namespace taffo;
 
 char FloatToFixed::ID = 0;
 
+static cl::opt<std::string> QueueDumpFile("flttofix-dump-queue",
+  cl::desc("Write the conversion queue and the outcome of the conversion of each value "
+    "to the given file, one JSON object per line"),
+  cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> ReportFile("flttofix-report",
+  cl::desc("Append a JSON line with the phase times and table sizes of the conversion to the given file"),
+  cl::value_desc("file"), cl::init(""));
+
 static RegisterPass<FloatToFixed> X(
   "flttofix",
   "Floating Point to Fixed Point conversion pass",
@@ -30,45 +54,372 @@ static RegisterPass<FloatToFixed> X(
 
 void FloatToFixed::getAnalysisUsage(llvm::AnalysisUsage &au) const
 {
-  au.addRequiredTransitive<LoopInfoWrapperPass>();
-  au.setPreservesAll();
+  au.addRequired<LoopInfoWrapperPass>();
+  if (isConversionPlanningEnabled())
+    au.addRequired<BlockFrequencyInfoWrapperPass>();
+  au.setPreservesCFG();
 }
 
 
 bool FloatToFixed::runOnModule(Module &m)
 {
-  llvm::SmallPtrSet<llvm::Value *, 32> local;
-  llvm::SmallPtrSet<llvm::Value *, 32> global;
-  readAllLocalMetadata(m, local);
-  readGlobalMetadata(m, global);
+  getLoopInfo = [this](Function &f) -> LoopInfo& {
+    return this->getAnalysis<LoopInfoWrapperPass>(f).getLoopInfo();
+  };
+  getBlockFrequencyInfo = [this](Function &f) -> BlockFrequencyInfo& {
+    return this->getAnalysis<BlockFrequencyInfoWrapperPass>(f).getBFI();
+  };
+  /* the function analyses requested by a module pass are not kept once
+   * the next function is analyzed */
+  releaseFunctionAnalyses = [](Function &f) {};
+  return convertModule(m);
+}
+
+
+PreservedAnalyses FloatToFixedPass::run(Module &m, ModuleAnalysisManager &am)
+{
+  FunctionAnalysisManager &fam = am.getResult<FunctionAnalysisManagerModuleProxy>(m).getManager();
+  
+  FloatToFixed flttofix;
+  flttofix.getLoopInfo = [&fam](Function &f) -> LoopInfo& {
+    return fam.getResult<LoopAnalysis>(f);
+  };
+  flttofix.getBlockFrequencyInfo = [&fam](Function &f) -> BlockFrequencyInfo& {
+    return fam.getResult<BlockFrequencyAnalysis>(f);
+  };
+  flttofix.releaseFunctionAnalyses = [&fam](Function &f) {
+    fam.clear(f, f.getName());
+  };
+  if (!flttofix.convertModule(m))
+    return PreservedAnalyses::all();
+  
+  /* Instructions are replaced and new functions are added, but the CFG of
+   * the existing functions never changes */
+  PreservedAnalyses pa;
+  pa.preserveSet<CFGAnalyses>();
+  pa.preserve<FunctionAnalysisManagerModuleProxy>();
+  return pa;
+}
+
+
+void flttofix::registerFloatToFixedPass(PassBuilder &pb)
+{
+  pb.registerPipelineParsingCallback(
+    [](StringRef name, ModulePassManager &mpm, ArrayRef<PassBuilder::PipelineElement>) {
+      if (name != "flttofix")
+        return false;
+      mpm.addPass(FloatToFixedPass());
+      return true;
+    });
+}
+
+
+/* Entry point of the new pass manager plugins: with it, the shared object
+ * built from this library can be loaded with opt -load-pass-plugin and
+ * run with -passes=flttofix, or loaded in clang with -fpass-plugin.
+ * Weak, so that a plugin bundling more passes can define its own. */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+  return {LLVM_PLUGIN_API_VERSION, "FloatToFixed", LLVM_VERSION_STRING, registerFloatToFixedPass};
+}
+
+
+size_t flttofix::getPeakResidentSetSize()
+{
+#ifdef LLVM_ON_UNIX
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  /* kilobytes everywhere else */
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+
+namespace {
+
+/** Times a phase of the conversion. The phase is reported by -time-passes
+ *  in the "flttofix" timer group, by -time-trace as "flttofix.<name>", and
+ *  by -flttofix-report through the list of phase times. */
+class PhaseTimer {
+  NamedRegionTimer timer;
+  TimeTraceScope trace;
+  std::vector<std::pair<std::string, double>>& times;
+  std::string name;
+  double start;
+
+public:
+  PhaseTimer(std::vector<std::pair<std::string, double>>& times, StringRef name, StringRef desc) :
+    timer(name, desc, "flttofix", "Float to fixed point conversion phases", TimePassesIsEnabled),
+    trace(("flttofix." + name).str(), StringRef()), times(times), name(name),
+    start(TimeRecord::getCurrentTime(true).getWallTime()) {}
+  ~PhaseTimer() {
+    times.push_back({name, TimeRecord::getCurrentTime(false).getWallTime() - start});
+  }
+};
+
+}
+
+
+bool FloatToFixed::convertModule(Module &m)
+{
+  phaseTimes.clear();
+  infoPeak = operandPoolPeak = functionPoolPeak = phiDataPeak = MemoryPeak();
+  llvm::SetVector<llvm::Value *> local;
+  llvm::SetVector<llvm::Value *> global;
+  {
+    PhaseTimer t(phaseTimes, "readAllLocalMetadata", "Read local metadata");
+    readAllLocalMetadata(m, local);
+  }
+  {
+    PhaseTimer t(phaseTimes, "readGlobalMetadata", "Read global metadata");
+    readGlobalMetadata(m, global);
+  }
+  recordMemoryUsage();
 
   std::vector<Value*> vals(local.begin(), local.end());
   vals.insert(vals.begin(), global.begin(), global.end());
   MetadataCount = vals.size();
 
-  sortQueue(vals);
-  propagateCall(vals, global);
-  LLVM_DEBUG(printConversionQueue(vals));
+  {
+    PhaseTimer t(phaseTimes, "sortQueue", "Sort conversion queue");
+    sortQueue(vals);
+  }
+  recordMemoryUsage();
+  {
+    PhaseTimer t(phaseTimes, "propagateCall", "Propagate through function calls");
+    propagateCall(vals, global);
+  }
+  recordMemoryUsage();
+  if (isConversionPlanningEnabled()) {
+    PhaseTimer t(phaseTimes, "planConversion", "Plan the conversion");
+    planConversion(vals);
+  }
+  numberQueuedValues(vals);
+  LLVM_DEBUG(printConversionQueue(m, dbgs(), vals));
   ConversionCount = vals.size();
 
-  performConversion(m, vals);
-  closePhiLoops();
-  cleanup(vals);
+  {
+    PhaseTimer t(phaseTimes, "performConversion", "Convert values");
+    performConversion(m, vals);
+  }
+  if (!QueueDumpFile.empty())
+    dumpConversionQueue(m, vals);
+  recordMemoryUsage();
+  {
+    PhaseTimer t(phaseTimes, "closePhiLoops", "Close phi loops");
+    closePhiLoops();
+  }
+  {
+    PhaseTimer t(phaseTimes, "cleanup", "Remove converted values");
+    cleanup(vals);
+  }
+  {
+    PhaseTimer t(phaseTimes, "linkMathRuntime", "Link the fixed point math runtime");
+    linkMathRuntime(m);
+  }
+  if (isFunctionCacheEnabled()) {
+    PhaseTimer t(phaseTimes, "saveCachedFunctions", "Save cached functions");
+    saveCachedFunctions();
+  }
+  {
+    PhaseTimer t(phaseTimes, "mergeIdenticalClones", "Merge identical clones");
+    mergeIdenticalClones(m);
+  }
+  recordMemoryUsage();
+  if (!ReportFile.empty())
+    writeReport(m, local.size() + global.size(), vals.size());
 
+  releaseValueInfo();
+  templateBodyInfo.clear();
+  mdInfoCache.clear();
+  loopDepthCache.clear();
+  innermostLoopCache.clear();
+  conversionCache.clear();
+  domTreeCache.clear();
+  loopNest.clear();
+  blockFreqCache.clear();
+  FixedPointTypeContext::get().releaseLLVMTypeCaches(m.getContext());
   return true;
 }
 
 
+void FloatToFixed::writeReport(Module& m, size_t numValues, size_t numQueued)
+{
+  std::error_code ec;
+  raw_fd_ostream out(ReportFile, ec, sys::fs::OF_Append | sys::fs::OF_Text);
+  if (ec) {
+    errs() << "warning: cannot write conversion report to " << ReportFile << ": " << ec.message() << "\n";
+    return;
+  }
+
+  json::Object phases;
+  double total = 0.0;
+  for (auto& phase: phaseTimes) {
+    phases[phase.first] = phase.second;
+    total += phase.second;
+  }
+  unsigned numFunctions = 0;
+  for (Function& f: m.functions())
+    if (!f.isDeclaration())
+      numFunctions++;
+
+  json::Object report{
+    {"module", m.getModuleIdentifier()},
+    {"functions", numFunctions},
+    {"values", (int64_t)numValues},
+    {"queue", (int64_t)numQueued},
+    {"wall_time", total},
+    {"phases", std::move(phases)},
+    {"peak_rss_bytes", (int64_t)getPeakResidentSetSize()},
+    {"peak_info", json::Object{{"entries", (int64_t)infoPeak.entries}, {"bytes", (int64_t)infoPeak.bytes}}},
+    {"peak_operand_pool", json::Object{{"entries", (int64_t)operandPoolPeak.entries}, {"bytes", (int64_t)operandPoolPeak.bytes}}},
+    {"peak_function_pool", json::Object{{"entries", (int64_t)functionPoolPeak.entries}, {"bytes", (int64_t)functionPoolPeak.bytes}}},
+    {"peak_phi_replacement_data", json::Object{{"entries", (int64_t)phiDataPeak.entries}, {"bytes", (int64_t)phiDataPeak.bytes}}}};
+  out << json::Value(std::move(report)) << "\n";
+}
+
+
+Timer *FloatToFixed::getFunctionTimer(Function *f)
+{
+  std::unique_ptr<Timer>& timer = functionTimers[f];
+  if (!timer) {
+    if (!functionTimerGroup)
+      functionTimerGroup.reset(new TimerGroup("flttofix-functions", "Float to fixed point conversion per function"));
+    timer.reset(new Timer(f->getName(), f->getName(), *functionTimerGroup));
+  }
+  return timer.get();
+}
+
+
+void FloatToFixed::recordMemoryUsage()
+{
+  /* std::map does not expose its footprint; approximate it with the size
+   * of its nodes */
+  size_t infoEntries = unnumberedInfo.size();
+  for (ValueInfo *vi: info)
+    infoEntries += vi != nullptr;
+  size_t operandPoolEntries = unnumberedOperandPool.size();
+  for (Value *v: operandPool)
+    operandPoolEntries += v != nullptr;
+  size_t infoBytes = valueNumbers.getMemorySize() + info.capacity() * sizeof(info[0]) +
+    unnumberedInfo.getMemorySize() + infoEntries * sizeof(ValueInfo);
+  size_t operandPoolBytes = operandPool.capacity() * sizeof(operandPool[0]) +
+    unnumberedOperandPool.getMemorySize();
+  size_t functionPoolBytes = 0;
+  for (auto& entry: functionPool)
+    functionPoolBytes += sizeof(entry) + 4 * sizeof(void *) + entry.first.second.capacity() * sizeof(entry.first.second[0]);
+  size_t phiDataBytes = phiReplacementData.capacity() * sizeof(phiReplacementData[0]) +
+    phiReplacementIndex.getMemorySize();
+
+  infoPeak.update(infoEntries, infoBytes);
+  operandPoolPeak.update(operandPoolEntries, operandPoolBytes);
+  functionPoolPeak.update(functionPool.size(), functionPoolBytes);
+  phiDataPeak.update(phiReplacementIndex.size(), phiDataBytes);
+  InfoPeakEntries = infoPeak.entries;
+  InfoPeakBytes = infoPeak.bytes;
+  OperandPoolPeakEntries = operandPoolPeak.entries;
+  OperandPoolPeakBytes = operandPoolPeak.bytes;
+  FunctionPoolPeakEntries = functionPoolPeak.entries;
+  FunctionPoolPeakBytes = functionPoolPeak.bytes;
+  PhiDataPeakEntries = phiDataPeak.entries;
+  PhiDataPeakBytes = phiDataPeak.bytes;
+
+  LLVM_DEBUG(dbgs() << "memory usage: info=" << infoEntries << " (" << infoBytes << "B)"
+                    << " operandPool=" << operandPoolEntries << " (" << operandPoolBytes << "B)"
+                    << " functionPool=" << functionPool.size() << " (" << functionPoolBytes << "B)"
+                    << " phiReplacementData=" << phiReplacementIndex.size() << " (" << phiDataBytes << "B)\n");
+}
+
+
+void FloatToFixed::numberQueuedValues(std::vector<Value *>& q)
+{
+  valueNumbers.reserve(valueNumbers.size() + q.size());
+  info.reserve(info.size() + q.size());
+  operandPool.reserve(operandPool.size() + q.size());
+  size_t next = 0;
+  for (Value *v: q) {
+    /* the annotations are not converted but just removed, as they only
+     * make sense before the conversion */
+    if (CallInst *anno = dyn_cast<CallInst>(v)) {
+      if (anno->getCalledFunction() && anno->getCalledFunction()->getName() == "llvm.var.annotation") {
+        eraseValue(anno);
+        anno->eraseFromParent();
+        continue;
+      }
+    }
+    if (!valueNumbers.insert({v, info.size()}).second)
+      continue;
+    info.push_back(unnumberedInfo.lookup(v));
+    operandPool.push_back(unnumberedOperandPool.lookup(v));
+    q[next++] = v;
+  }
+  q.resize(next);
+
+  /* rebuild the side maps rather than erasing from them, which would
+   * leave them full of tombstones */
+  DenseMap<Value *, ValueInfo *> otherInfo;
+  for (auto& vi: unnumberedInfo)
+    if (!valueNumbers.count(vi.first))
+      otherInfo.insert(vi);
+  unnumberedInfo = std::move(otherInfo);
+  DenseMap<Value *, Value *> otherOperands;
+  for (auto& op: unnumberedOperandPool)
+    if (!valueNumbers.count(op.first))
+      otherOperands.insert(op);
+  unnumberedOperandPool = std::move(otherOperands);
+}
+
+
 int FloatToFixed::getLoopNestingLevelOfValue(llvm::Value *v)
 {
   Instruction *inst = dyn_cast<Instruction>(v);
   if (!inst)
     return 0;
 
-  Function *fun = inst->getFunction();
-  LoopInfo &li = this->getAnalysis<LoopInfoWrapperPass>(*fun).getLoopInfo();
   BasicBlock *bb = inst->getParent();
-  return li.getLoopDepth(bb);
+  auto cached = loopDepthCache.find(bb);
+  if (cached != loopDepthCache.end())
+    return cached->second;
+
+  /* the CFG never changes during the conversion, so the depth of all the
+   * blocks of the function can be recorded at once */
+  Function *fun = inst->getFunction();
+  LoopInfo &li = getLoopInfo(*fun);
+  for (BasicBlock &fbb: *fun)
+    loopDepthCache[&fbb] = li.getLoopDepth(&fbb);
+  return loopDepthCache[bb];
+}
+
+
+int FloatToFixed::getInnermostLoop(BasicBlock *bb)
+{
+  auto cached = innermostLoopCache.find(bb);
+  if (cached != innermostLoopCache.end())
+    return cached->second;
+  
+  /* the LoopInfo may not outlive the next request for another function,
+   * therefore the loop nest of the whole function is copied at once */
+  Function *fun = bb->getParent();
+  LoopInfo &li = getLoopInfo(*fun);
+  DenseMap<Loop *, int> loopIds;
+  for (Loop *l: li.getLoopsInPreorder()) {
+    BasicBlock *preheader = l->getLoopPreheader();
+    int parent = l->getParentLoop() ? loopIds.lookup(l->getParentLoop()) : -1;
+    loopIds[l] = loopNest.size();
+    loopNest.push_back({preheader ? preheader->getTerminator() : nullptr, parent});
+  }
+  for (BasicBlock &fbb: *fun) {
+    Loop *l = li.getLoopFor(&fbb);
+    innermostLoopCache[&fbb] = l ? loopIds.lookup(l) : -1;
+  }
+  return innermostLoopCache[bb];
 }
 
 
@@ -93,11 +444,15 @@ void FloatToFixed::openPhiLoop(PHINode *phi)
   } else {
     info.placeh_conv = info.placeh_noconv;
   }
-  operandPool[info.placeh_noconv] = info.placeh_conv;
+  setConvertedValue(info.placeh_noconv, info.placeh_conv);
   
   LLVM_DEBUG(dbgs() << "created placeholder (non-converted=[" << *info.placeh_noconv << "], converted=[" << *info.placeh_conv << "]) for phi " << *phi << "\n");
   
-  phiReplacementData[phi] = info;
+  auto phiIdx = phiReplacementIndex.insert({phi, phiReplacementData.size()});
+  if (phiIdx.second)
+    phiReplacementData.push_back({phi, info});
+  else
+    phiReplacementData[phiIdx.first->second].second = info;
 }
 
 
@@ -105,10 +460,12 @@ void FloatToFixed::closePhiLoops()
 {
   LLVM_DEBUG(dbgs() << __PRETTY_FUNCTION__ << " begin\n");
   
-  for (auto data: phiReplacementData) {
+  for (auto& data: phiReplacementData) {
     PHINode *origphi = data.first;
+    if (!origphi)
+      continue;
     PHIInfo& info = data.second;
-    Value *substphi = operandPool[origphi];
+    Value *substphi = convertedValue(origphi);
     
     LLVM_DEBUG(dbgs() << "restoring data flow of phi " << *origphi << "\n");
     if (info.placeh_noconv != info.placeh_conv)
@@ -129,19 +486,33 @@ void FloatToFixed::closePhiLoops()
 
 void FloatToFixed::sortQueue(std::vector<Value *> &vals)
 {
+  /* Moving a value to the end of the queue is implemented by leaving a
+   * tombstone (nullptr) in its old slot and appending it again; queuePos
+   * always points to the live slot of each value. This keeps the ordering
+   * identical to an erase-and-push_back scheme without the quadratic cost. */
+  DenseMap<Value *, size_t> queuePos;
+  queuePos.reserve(vals.size());
+  for (size_t i = 0; i < vals.size(); i++) {
+    if (!queuePos.insert({vals[i], i}).second)
+      vals[i] = nullptr;
+  }
+  
   size_t next = 0;
   while (next < vals.size()) {
-    Value *v = vals.at(next);
+    Value *v = vals[next];
+    if (!v) {
+      next++;
+      continue;
+    }
     LLVM_DEBUG(dbgs() << "[V] " << *v << "\n");
-    SmallPtrSet<Value*, 5> roots;
-    for (Value *oldroot: valueInfo(v)->roots) {
-      if (valueInfo(oldroot)->roots.empty())
-        roots.insert(oldroot);
+    SmallVector<unsigned, 4> roots;
+    for (unsigned oldroot: valueInfo(v)->roots) {
+      if (valueInfo(rootValues[oldroot])->roots.empty())
+        roots.push_back(oldroot);
     }
-    valueInfo(v)->roots.clear();
-    valueInfo(v)->roots.insert(roots.begin(), roots.end());
+    valueInfo(v)->roots.assign(roots.begin(), roots.end());
     if (roots.empty()) {
-      roots.insert(v);
+      roots.push_back(getRootId(v));
     }
     
     if (PHINode *phi = dyn_cast<PHINode>(v))
@@ -149,7 +520,7 @@ void FloatToFixed::sortQueue(std::vector<Value *> &vals)
 
     for (auto *u: v->users()) {
       if (Instruction *i = dyn_cast<Instruction>(u)) {
-        if (functionPool.find(i->getFunction()) != functionPool.end()) {
+        if (templateFunctions.count(i->getFunction())) {
           LLVM_DEBUG(dbgs() << "old function: skipped " << *u << "\n");
           continue;
         }
@@ -157,15 +528,9 @@ void FloatToFixed::sortQueue(std::vector<Value *> &vals)
     
       /* Insert u at the end of the queue.
        * If u exists already in the queue, *move* it to the end instead. */
-      for (int i=0; i<vals.size();) {
-        if (vals[i] == u) {
-          vals.erase(vals.begin() + i);
-          if (i < next)
-            next--;
-        } else {
-          i++;
-        }
-      }
+      auto upos = queuePos.find(u);
+      if (upos != queuePos.end())
+        vals[upos->second] = nullptr;
       
       if (!hasInfo(u)) {
         LLVM_DEBUG(dbgs() << "[WARNING] Value " << *u << " will not be converted because it has no metadata\n");
@@ -174,13 +539,16 @@ void FloatToFixed::sortQueue(std::vector<Value *> &vals)
       }
 
       LLVM_DEBUG(dbgs() << "[U] " << *u << "\n");
+      queuePos[u] = vals.size();
       vals.push_back(u);
       if (PHINode *phi = dyn_cast<PHINode>(u))
         openPhiLoop(phi);
-      valueInfo(u)->roots.insert(roots.begin(), roots.end());
+      valueInfo(u)->addRoots(roots);
     }
     next++;
   }
+  
+  vals.erase(std::remove(vals.begin(), vals.end(), nullptr), vals.end());
 
   for (Value *v: vals) {
     assert(hasInfo(v) && "all values in the queue should have a valueInfo by now");
@@ -189,14 +557,14 @@ void FloatToFixed::sortQueue(std::vector<Value *> &vals)
       valueInfo(v)->noTypeConversion = true;
     }
     
-    SmallPtrSetImpl<Value *> &roots = valueInfo(v)->roots;
+    SmallVectorImpl<unsigned> &roots = valueInfo(v)->roots;
     if (roots.empty()) {
       valueInfo(v)->isRoot = true;
       if (isa<Instruction>(v) && !isa<AllocaInst>(v)) {
         /* non-alloca roots must have been generated by backtracking */
         valueInfo(v)->isBacktrackingNode = true;
       }
-      roots.insert(v);
+      roots.push_back(getRootId(v));
     }
   }
 }
@@ -226,91 +594,76 @@ bool potentiallyUsesMemory(Value *val)
 
 void FloatToFixed::cleanup(const std::vector<Value*>& q)
 {
-  std::vector<Value*> roots;
-  for (Value *v: q) {
-    if (valueInfo(v)->isRoot == true)
-      roots.push_back(v);
-  }
-
-  DenseMap<Value*, bool> isrootok;
-  for (Value *root: roots)
-    isrootok[root] = true;
-
-  for (Value *qi: q) {
-    Value *cqi = operandPool[qi];
+  /* A value which was not converted and may use memory invalidates its
+   * roots, as the original data flow they belong to must be kept */
+  /* the queue is numbered, see performConversion() */
+  BitVector invalidRoots(rootValues.size());
+  for (unsigned n = 0; n < q.size(); n++) {
+    Value *qi = q[n];
+    Value *cqi = operandPool[n];
     assert(cqi && "every value should have been processed at this point!!");
-    if (cqi == ConversionError) {
-      if (!potentiallyUsesMemory(qi)) {
-        continue;
-      }
-      LLVM_DEBUG(qi->print(errs());
-            if (Instruction *i = dyn_cast<Instruction>(qi))
-              errs() << " in function " << i->getFunction()->getName();
-            errs() << " not converted; invalidates roots ");
-      const auto& rootsaffected = valueInfo(qi)->roots;
-      for (Value *root: rootsaffected) {
-        isrootok[root] = false;
-        LLVM_DEBUG(root->print(errs()));
-      }
-      LLVM_DEBUG(errs() << '\n');
-    }
+    if (cqi != ConversionError || !potentiallyUsesMemory(qi))
+      continue;
+    LLVM_DEBUG(qi->print(errs());
+          if (Instruction *i = dyn_cast<Instruction>(qi))
+            errs() << " in function " << i->getFunction()->getName();
+          errs() << " not converted; invalidates roots ";
+          for (unsigned root: info[n]->roots)
+            rootValues[root]->print(errs());
+          errs() << '\n');
+    for (unsigned root: info[n]->roots)
+      invalidRoots.set(root);
   }
-
-  std::vector<Instruction *> toErase;
-
-  auto clear = [&] (bool (*toDelete) (const Instruction &Y)) {
-    for (Value *v: q) {
-      Instruction *i = dyn_cast<Instruction>(v);
-      if (!i || (!toDelete(*i)))
-        continue;
-      if (operandPool[v] == v) {
-        LLVM_DEBUG(dbgs() << *i << " not deleted, as it was converted by self-mutation\n");
-        continue;
-      }
-      const auto &roots = valueInfo(v)->roots;
-
-      bool allok = true;
-      for (Value *root: roots) {
-        if (!isrootok[root]) {
-          LLVM_DEBUG(i->print(errs());
-                    errs() << " not deleted: involves root ";
-                    root->print(errs());
-                    errs() << '\n');
-          allok = false;
-          break;
-        }
-      }
-      if (allok) {
-        if (!i->use_empty())
-          i->replaceAllUsesWith(UndefValue::get(i->getType()));
-        toErase.push_back(i);
-      }
-    }
-  };
-
-  clear(isa<StoreInst>);
-  
-  /* remove calls manually because DCE does not do it as they may have
-   * side effects */
-  clear(isa<CallInst>);
-  clear(isa<InvokeInst>);
-  
-  clear(isa<BranchInst>);
   
   /* remove old phis manually as DCE cannot remove values having a circular
    * dependence on a phi */
   phiReplacementData.clear();
-  clear(isa<PHINode>);
+  phiReplacementIndex.clear();
+
+  std::vector<Instruction *> toErase;
+  for (unsigned n = 0; n < q.size(); n++) {
+    /* remove stores, calls and branches manually because DCE does not do
+     * it as they may have side effects */
+    Instruction *i = dyn_cast<Instruction>(q[n]);
+    if (!i || !(isa<StoreInst>(i) || isa<CallInst>(i) || isa<InvokeInst>(i) ||
+        isa<BranchInst>(i) || isa<PHINode>(i)))
+      continue;
+    if (operandPool[n] == i) {
+      LLVM_DEBUG(dbgs() << *i << " not deleted, as it was converted by self-mutation\n");
+      continue;
+    }
+    auto invalidRoot = llvm::find_if(info[n]->roots, [&](unsigned root) { return invalidRoots.test(root); });
+    if (invalidRoot != info[n]->roots.end()) {
+      LLVM_DEBUG(dbgs() << *i << " not deleted: involves root " << *rootValues[*invalidRoot] << "\n");
+      continue;
+    }
+    if (!i->use_empty())
+      i->replaceAllUsesWith(UndefValue::get(i->getType()));
+    toErase.push_back(i);
+  }
 
   for (Instruction *v: toErase) {
     v->eraseFromParent();
   }
+  
+  /* Placeholders are only left in use by values which were not deleted */
+  for (WeakVH& placeh: placeholders) {
+    Instruction *i = cast_or_null<Instruction>(placeh);
+    if (!i)
+      continue;
+    if (!i->use_empty())
+      i->replaceAllUsesWith(UndefValue::get(i->getType()));
+    eraseValue(i);
+    i->eraseFromParent();
+  }
+  placeholders.clear();
 }
 
 
-void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetImpl<llvm::Value *> &global)
+void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SetVector<llvm::Value *> &global)
 {
   SmallPtrSet<Function *, 16> oldFuncs;
+  std::unique_ptr<ModuleSlotTracker> cacheSlotTracker;
   
   for (int i=0; i < vals.size(); i++) {
     Value *valsi = vals[i];
@@ -320,12 +673,14 @@ void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetIm
       continue;
     
     bool alreadyHandledNewF;
+    FixedPointSignature fixArgs;
     Function *oldF = call.getCalledFunction();
-    Function *newF = createFixFun(&call, &alreadyHandledNewF);
+    Function *newF = createFixFun(&call, &alreadyHandledNewF, &fixArgs);
     if (!newF) {
       LLVM_DEBUG(dbgs() << "Attempted to clone function " << oldF->getName() << " but failed\n");
       continue;
     }
+    callTargets[call.getInstruction()] = newF;
     if (alreadyHandledNewF) {
       oldFuncs.insert(oldF);
       continue;
@@ -334,6 +689,35 @@ void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetIm
     LLVM_DEBUG(dbgs() << "Converting function " << oldF->getName() << " : " << *oldF->getType()
                << " into " << newF->getName() << " : " << *newF->getType() << "\n");
     
+    /* fixed point types of the converted arguments of this clone */
+    DenseMap<unsigned, FixedPointType> argFixpTypes;
+    for (auto& sigItem: fixArgs) {
+      if (sigItem.first >= 0)
+        argFixpTypes[sigItem.first] = sigItem.second;
+    }
+    
+    if (isFunctionCacheEnabled() && isCacheableFunction(oldF)) {
+      if (!cacheSlotTracker)
+        cacheSlotTracker.reset(new ModuleSlotTracker(oldF->getParent()));
+      std::string cacheKey = getFunctionCacheKey(*cacheSlotTracker, oldF, newF, fixArgs);
+      
+      if (loadCachedFunction(newF, cacheKey)) {
+        /* The body is already converted; only the arguments need a
+         * ValueInfo, for matching them in convertCall */
+        auto oldIt = oldF->arg_begin();
+        auto newIt = newF->arg_begin();
+        for (unsigned argno = 0; oldIt != oldF->arg_end(); oldIt++, newIt++, argno++) {
+          if (!hasInfo(oldIt))
+            continue;
+          *(demandValueInfo(newIt)) = *(valueInfo(oldIt));
+          valueInfo(newIt)->fixpType = argFixpTypes[argno];
+        }
+        oldFuncs.insert(oldF);
+        continue;
+      }
+      cacheableClones.push_back(std::make_pair(newF, cacheKey));
+    }
+    
     ValueToValueMapTy origValToCloned; // Create Val2Val mapping and clone function
     Function::arg_iterator newIt = newF->arg_begin();
     Function::arg_iterator oldIt = oldF->arg_begin();
@@ -350,7 +734,7 @@ void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetIm
     newIt = newF->arg_begin();
     for (int i=0; oldIt != oldF->arg_end() ; oldIt++, newIt++,i++) {
       if (oldIt->getType() != newIt->getType()){
-        FixedPointType fixtype = valueInfo(oldIt)->fixpType;
+        FixedPointType fixtype = argFixpTypes[i];
         
         //append fixp info to arg name
         newIt->setName(newIt->getName() + "." + fixtype.toString());
@@ -369,27 +753,43 @@ void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetIm
           U.set(placehValue);
         }
         *(newValueInfo(placehValue)) = *(valueInfo(oldIt));
-        operandPool[placehValue] = newIt;
+        valueInfo(placehValue)->fixpType = fixtype;
+        setConvertedValue(placehValue, newIt);
         
         valueInfo(placehValue)->isArgumentPlaceholder = true;
         newVals.push_back(placehValue);
         
-        /* No need to mark the argument itself, readLocalMetadata will
-         * do it in a bit as its metadata has been cloned as well */
+        /* No need to mark the argument itself, it inherits the ValueInfo
+         * of the argument of the template in a bit */
       }
     }
     
     newVals.insert(newVals.end(), global.begin(), global.end());
-    SmallPtrSet<Value*, 32> localFix;
-    readLocalMetadata(*newF, localFix);
-    newVals.insert(newVals.end(), localFix.begin(), localFix.end());
     
-    /* Make sure that the new arguments have correct ValueInfo */
+    /* The clone carries the same metadata as the template; reuse the
+     * ValueInfo decoded from the template through the value map instead
+     * of reading the metadata of every clone again */
     oldIt = oldF->arg_begin();
     newIt = newF->arg_begin();
     for (; oldIt != oldF->arg_end(); oldIt++, newIt++) {
+      if (hasInfo(oldIt))
+        *(demandValueInfo(newIt)) = *(valueInfo(oldIt));
+    }
+    for (auto& tmplInfo: readTemplateMetadata(*oldF)) {
+      Value *newv = origValToCloned.lookup(tmplInfo.first);
+      if (!newv)
+        continue;
+      *(demandValueInfo(newv)) = tmplInfo.second;
+      newVals.push_back(newv);
+    }
+    
+    /* Make sure that the new arguments have correct ValueInfo */
+    oldIt = oldF->arg_begin();
+    newIt = newF->arg_begin();
+    for (unsigned argno = 0; oldIt != oldF->arg_end(); oldIt++, newIt++, argno++) {
       if (oldIt->getType() != newIt->getType()) {
         *(valueInfo(newIt)) = *(valueInfo(oldIt));
+        valueInfo(newIt)->fixpType = argFixpTypes[argno];
       }
     }
     
@@ -420,30 +820,27 @@ void FloatToFixed::propagateCall(std::vector<Value *> &vals, llvm::SmallPtrSetIm
   }
   
   /* Remove instructions of the old functions from the queue */
-  int removei, removej;
-  for (removei=0, removej=0; removej<vals.size(); removej++) {
-    vals[removei] = vals[removej];
-    Value *val = vals[removej];
-    bool toDelete = false;
+  vals.erase(std::remove_if(vals.begin(), vals.end(), [&](Value *val) -> bool {
     if (Instruction *inst = dyn_cast<Instruction>(val)) {
-      if (oldFuncs.count(inst->getFunction())) {
-        toDelete = true;
-        if (PHINode *phi = dyn_cast_or_null<PHINode>(inst)) {
-          phiReplacementData.erase(phi);
+      if (!oldFuncs.count(inst->getFunction()))
+        return false;
+      if (PHINode *phi = dyn_cast<PHINode>(inst)) {
+        auto phiIdx = phiReplacementIndex.find(phi);
+        if (phiIdx != phiReplacementIndex.end()) {
+          phiReplacementData[phiIdx->second].first = nullptr;
+          phiReplacementIndex.erase(phiIdx);
         }
       }
+      return true;
     } else if (Argument *arg = dyn_cast<Argument>(val)) {
-      if (oldFuncs.count(arg->getParent()))
-        toDelete = true;
+      return oldFuncs.count(arg->getParent());
     }
-    if (!toDelete)
-      removei++;
-  }
-  vals.resize(removei);
+    return false;
+  }), vals.end());
 }
 
 
-Function* FloatToFixed::createFixFun(CallSite* call, bool *old)
+Function* FloatToFixed::createFixFun(CallSite* call, bool *old, FixedPointSignature *signature)
 {
   Function *oldF = call->getCalledFunction();
   assert(oldF && "bitcasted function pointers and such not handled atm");
@@ -455,51 +852,56 @@ Function* FloatToFixed::createFixFun(CallSite* call, bool *old)
     return nullptr;
   }
 
-  std::vector<Type*> typeArgs;
-  std::vector<std::pair<int, FixedPointType>> fixArgs; //for match already converted function
+  FixedPointSignature fixArgs; //for match already converted function
+  getFixedPointSignature(call, fixArgs);
+  if (signature)
+    *signature = fixArgs;
 
+  auto poolKey = std::make_pair(oldF, fixArgs);
+  auto pooled = functionPool.find(poolKey); //check if is previously converted
+  if (pooled != functionPool.end()) {
+    Function *newF = pooled->second;
+    LLVM_DEBUG(dbgs() << *(call->getInstruction()) <<  " use already converted function : " <<
+                 newF->getName() << " " << *newF->getType() << "\n";);
+    if (old) *old = true;
+    return newF;
+  }
+  if (old) *old = false;
+
+  /* The name encodes the whole signature: clones with the same LLVM type
+   * but different formats must not be told apart by creation order, as the
+   * function cache binds the callees of cached bodies by name */
   std::string suffix;
-  if(isFloatType(oldF->getReturnType())) { //ret value in signature
-    FixedPointType retValType = valueInfo(call->getInstruction())->fixpType;
-    suffix = retValType.toString();
-    fixArgs.push_back(std::pair<int, FixedPointType>(-1, retValType));
+  raw_string_ostream suffixstm(suffix);
+  auto sigItem = fixArgs.begin();
+  if (sigItem != fixArgs.end() && sigItem->first == -1) { //ret value in signature
+    suffixstm << sigItem->second;
+    sigItem++;
   } else {
-    suffix = "fixp";
+    suffixstm << "fixp";
   }
+  for (auto argItem = sigItem; argItem != fixArgs.end(); argItem++)
+    suffixstm << "_a" << argItem->first << argItem->second;
+  suffixstm.flush();
 
+  std::vector<Type*> typeArgs;
   int i=0;
   for (auto arg = oldF->arg_begin(); arg != oldF->arg_end(); arg++, i++) {
-    Value *v = dyn_cast<Value>(arg);
     Type* newTy;
-    if (hasInfo(v)) {
-      fixArgs.push_back(std::pair<int, FixedPointType>(i,valueInfo(v)->fixpType));
-      newTy = getLLVMFixedPointTypeForFloatValue(v);
+    if (sigItem != fixArgs.end() && sigItem->first == i) {
+      newTy = getLLVMFixedPointTypeForFloatType(arg->getType(), sigItem->second);
+      sigItem++;
     } else {
-      newTy = v->getType();
+      newTy = arg->getType();
     }
     typeArgs.push_back(newTy);
   }
-
-  Function *newF = functionPool[oldF]; //check if is previously converted
-  if (newF) {
-    LLVM_DEBUG(dbgs() << *(call->getInstruction()) <<  " use already converted function : " <<
-                 newF->getName() << " " << *newF->getType() << "\n";);
-    if (old) *old = true;
-    return newF;
-  }
-  if (old) *old = false;
   
   Type *retType = oldF->getReturnType();
-  if (hasInfo(call->getInstruction())) {
-    if (!valueInfo(call->getInstruction())->noTypeConversion)
-      retType = getLLVMFixedPointTypeForFloatValue(call->getInstruction());
-  }
+  if (!fixArgs.empty() && fixArgs[0].first == -1)
+    retType = getLLVMFixedPointTypeForFloatType(retType, fixArgs[0].second);
 
-  FunctionType *newFunTy = FunctionType::get(
-      isFloatType(oldF->getReturnType()) ?
-      retType :
-      oldF->getReturnType(),
-      typeArgs, oldF->isVarArg());
+  FunctionType *newFunTy = FunctionType::get(retType, typeArgs, oldF->isVarArg());
 
   LLVM_DEBUG({
     dbgs() << "creating function " << oldF->getName() << "_" << suffix << " with types ";
@@ -509,36 +911,182 @@ Function* FloatToFixed::createFixFun(CallSite* call, bool *old)
     dbgs() << "\n";
   });
 
-  newF = Function::Create(newFunTy, oldF->getLinkage(), oldF->getName() + "_" + suffix, oldF->getParent());
-  functionPool[oldF] = newF; //add to pool
+  /* a body restored from the function cache may have declared this clone
+   * already */
+  std::string name = (oldF->getName() + "_" + suffix).str();
+  Function *newF = oldF->getParent()->getFunction(name);
+  if (newF && newF->isDeclaration() && newF->getFunctionType() == newFunTy) {
+    newF->setLinkage(oldF->getLinkage());
+  } else {
+    newF = Function::Create(newFunTy, oldF->getLinkage(), name, oldF->getParent());
+  }
+  functionPool[poolKey] = newF; //add to pool
   FunctionCreated++;
   return newF;
 }
 
 
-void FloatToFixed::printConversionQueue(std::vector<Value*> vals)
+void FloatToFixed::getFixedPointSignature(CallSite *call, FixedPointSignature& fixArgs)
+{
+  Function *oldF = call->getCalledFunction();
+  
+  if (isFloatType(oldF->getReturnType())) {
+    ValueInfo *retInfo = valueInfo(call->getInstruction());
+    if (!retInfo->noTypeConversion)
+      fixArgs.push_back(std::pair<int, FixedPointType>(-1, retInfo->fixpType));
+  }
+
+  int i=0;
+  auto call_arg = call->arg_begin();
+  for (auto arg = oldF->arg_begin(); arg != oldF->arg_end(); arg++, call_arg++, i++) {
+    Value *v = dyn_cast<Value>(arg);
+    if (!hasInfo(v))
+      continue;
+    
+    /* specialize on the format of the actual argument, so that the call
+     * does not need any rescaling */
+    FixedPointType argType = valueInfo(v)->fixpType;
+    Value *actual = *call_arg;
+    if (hasInfo(actual) && actual->getType() == v->getType()) {
+      ValueInfo *actualInfo = valueInfo(actual);
+      if (!actualInfo->noTypeConversion && !actualInfo->fixpType.isInvalid())
+        argType = actualInfo->fixpType;
+    }
+    fixArgs.push_back(std::pair<int, FixedPointType>(i, argType));
+  }
+}
+
+
+void FloatToFixed::mergeIdenticalClones(Module& m)
+{
+  DenseMap<Function *, Function *> sourceOfClone;
+  for (auto& entry: functionPool)
+    sourceOfClone[entry.second] = entry.first.first;
+  
+  /* visit the clones in module order to always keep the same one */
+  DenseMap<Function *, SmallVector<Function *, 2>> keptClones;
+  std::vector<Function *> toErase;
+  GlobalNumberState gn;
+  for (Function &f: m) {
+    auto source = sourceOfClone.find(&f);
+    if (source == sourceOfClone.end())
+      continue;
+    
+    SmallVectorImpl<Function *> &kept = keptClones[source->second];
+    Function *same = nullptr;
+    for (Function *k: kept) {
+      if (FunctionComparator(k, &f, &gn).compare() == 0) {
+        same = k;
+        break;
+      }
+    }
+    
+    if (same) {
+      LLVM_DEBUG(dbgs() << "function " << f.getName() << " is identical to " << same->getName() << "; removed\n");
+      f.replaceAllUsesWith(same);
+      toErase.push_back(&f);
+      FunctionMerged++;
+    } else {
+      kept.push_back(&f);
+    }
+  }
+  
+  for (Function *f: toErase) {
+    releaseFunctionAnalyses(*f);
+    f->eraseFromParent();
+  }
+}
+
+
+void FloatToFixed::dumpConversionQueue(Module& m, const std::vector<Value*>& vals)
 {
-  if (vals.size() > 1000) {
-    dbgs() << "not printing the conversion queue because it exceeds 1000 items\n";
+  std::error_code ec;
+  raw_fd_ostream out(QueueDumpFile, ec, sys::fs::OF_Text);
+  if (ec) {
+    errs() << "warning: cannot write conversion queue to " << QueueDumpFile << ": " << ec.message() << "\n";
     return;
   }
+  printConversionQueue(m, out, vals);
+}
+
+
+void FloatToFixed::printConversionQueue(Module& m, raw_ostream& out, const std::vector<Value*>& vals)
+{
+  DenseMap<Value *, size_t> ids;
+  ids.reserve(vals.size());
+  for (size_t i = 0; i < vals.size(); i++)
+    ids.insert({vals[i], i});
   
-  dbgs() << "conversion queue:\n";
-  for (Value *val: vals) {
-    dbgs() << "bt=" << valueInfo(val)->isBacktrackingNode << " ";
-    dbgs() << "noconv=" << valueInfo(val)->noTypeConversion << " ";
-    dbgs() << "type=" << valueInfo(val)->fixpType << " ";
-    if (Instruction *i = dyn_cast<Instruction>(val)) {
-      dbgs() << " fun='" << i->getFunction()->getName() << "' ";
+  /* Numbering the values of a function is linear in its size, therefore
+   * the operands are printed one function at a time with a single slot
+   * tracker, and then emitted in queue order */
+  std::vector<std::string> operands(vals.size());
+  {
+    MapVector<const Function *, std::vector<size_t>> byFunction;
+    for (size_t i = 0; i < vals.size(); i++) {
+      const Function *f = nullptr;
+      if (Instruction *inst = dyn_cast<Instruction>(vals[i]))
+        f = inst->getFunction();
+      else if (Argument *arg = dyn_cast<Argument>(vals[i]))
+        f = arg->getParent();
+      byFunction[f].push_back(i);
+    }
+    ModuleSlotTracker mst(&m);
+    for (auto& group: byFunction) {
+      if (group.first)
+        mst.incorporateFunction(*group.first);
+      for (size_t i: group.second) {
+        raw_string_ostream stm(operands[i]);
+        vals[i]->printAsOperand(stm, false, mst);
+      }
+    }
+  }
+  
+  for (size_t i = 0; i < vals.size(); i++) {
+    Value *val = vals[i];
+    ValueInfo *vi = valueInfo(val);
+    
+    StringRef opcode = "value";
+    StringRef fun;
+    if (Instruction *inst = dyn_cast<Instruction>(val)) {
+      opcode = inst->getOpcodeName();
+      fun = inst->getFunction()->getName();
+    } else if (Argument *arg = dyn_cast<Argument>(val)) {
+      opcode = "argument";
+      fun = arg->getParent()->getName();
+    } else if (isa<GlobalVariable>(val)) {
+      opcode = "global";
+    }
+    
+    json::Array roots;
+    for (unsigned root: vi->roots) {
+      auto rootid = ids.find(rootValues[root]);
+      roots.push_back(rootid != ids.end() ? (int64_t)rootid->second : (int64_t)-1);
     }
     
-    dbgs() << "roots=[";
-    for (Value *rootv: valueInfo(val)->roots) {
-      dbgs() << *rootv << ", ";
+    StringRef status = "pending";
+    Value *conv = convertedValue(val);
+    if (conv) {
+      if (conv == ConversionError)
+        status = "error";
+      else if (conv == Unsupported)
+        status = "unsupported";
+      else if (conv == val)
+        status = "unchanged";
+      else
+        status = "converted";
     }
-    dbgs() << "] ";
     
-    dbgs() << *val << "\n";
+    out << json::Value(json::Object{
+      {"id", (int64_t)i},
+      {"function", fun},
+      {"opcode", opcode},
+      {"value", operands[i]},
+      {"type", vi->fixpType.toString()},
+      {"noconv", vi->noTypeConversion},
+      {"bt", vi->isBacktrackingNode},
+      {"root", vi->isRoot},
+      {"roots", std::move(roots)},
+      {"status", status}}) << "\n";
   }
-  dbgs() << "\n\n";
 }
@@ -1,24 +1,45 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
-#include "llvm/IR/ValueMap.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
 #include "TypeUtils.h"
 #include "Metadata.h"
 #include "FixedPointType.h"
 #include "InputInfo.h"
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <set>
 
 #ifndef __LLVM_FLOAT_TO_FIXED_PASS_H__
 #define __LLVM_FLOAT_TO_FIXED_PASS_H__
 
 
+namespace llvm {
+class PassBuilder;
+class ModuleSlotTracker;
+}
+
 #define DEBUG_TYPE "taffo-conversion"
 #define DEBUG_ANNOTATION "annotation"
 
@@ -33,6 +54,21 @@ STATISTIC(FallbackCount, "Number of instructions not replaced by a fixed-point-n
 STATISTIC(ConversionCount, "Number of instructions affected by flttofix");
 STATISTIC(MetadataCount, "Number of valid Metadata found");
 STATISTIC(FunctionCreated, "Number of fixed point function inserted");
+STATISTIC(FunctionMerged, "Number of fixed point functions removed because identical to another one");
+STATISTIC(NarrowComparisonCount, "Number of comparisons performed at the width of their widest operand thanks to range information");
+STATISTIC(ReusedConversionCount, "Number of conversions reused instead of being generated again");
+STATISTIC(HoistedConversionCount, "Number of conversions placed in a loop preheader instead of inside the loop");
+STATISTIC(PlannedOutCount, "Number of values left in floating point by the conversion planner");
+STATISTIC(MathRuntimeCallCount, "Number of math function calls replaced by the fixed point math runtime");
+STATISTIC(FunctionCacheHits, "Number of fixed point functions restored from the persistent cache");
+STATISTIC(InfoPeakEntries, "Peak number of entries of the value info table");
+STATISTIC(InfoPeakBytes, "Peak size in bytes of the value info table");
+STATISTIC(OperandPoolPeakEntries, "Peak number of entries of the operand pool");
+STATISTIC(OperandPoolPeakBytes, "Peak size in bytes of the operand pool");
+STATISTIC(FunctionPoolPeakEntries, "Peak number of entries of the function pool");
+STATISTIC(FunctionPoolPeakBytes, "Peak size in bytes of the function pool");
+STATISTIC(PhiDataPeakEntries, "Peak number of entries of the phi replacement table");
+STATISTIC(PhiDataPeakBytes, "Peak size in bytes of the phi replacement table");
 
 
 /* flags in conversionPool */
@@ -40,13 +76,19 @@ extern llvm::Value *ConversionError;
 extern llvm::Value *Unsupported;
 
 
+/** Metadata requesting saturating fixed point arithmetic for an instruction
+ *  or for a whole function */
+#define SATURATE_METADATA "taffo.saturate"
+
+
 namespace flttofix {
 
 
 struct ValueInfo {
   bool isBacktrackingNode;
   bool isRoot;
-  llvm::SmallPtrSet<llvm::Value*, 5> roots;
+  /** Ids of the roots of the value, sorted (see FloatToFixed::getRootId()) */
+  llvm::SmallVector<unsigned, 2> roots;
   unsigned int fixpTypeRootDistance = UINT_MAX;
   
   /* Disable type conversion even if the instruction
@@ -59,56 +101,240 @@ struct ValueInfo {
   // and if operation == Convert
   FixedPointType fixpType;
   llvm::Type *origType = nullptr;
+  
+  void addRoots(llvm::ArrayRef<unsigned> ids) {
+    llvm::SmallVector<unsigned, 4> merged;
+    std::set_union(roots.begin(), roots.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+    roots.assign(merged.begin(), merged.end());
+  }
 };
 
 
+/** Fixed point types of the return value (index -1) and of the arguments
+ *  of a function, ordered by index. Arguments which are not converted do
+ *  not appear. */
+typedef std::vector<std::pair<int, FixedPointType>> FixedPointSignature;
+
+
 struct PHIInfo {
   llvm::Value *placeh_noconv;
   llvm::Value *placeh_conv;
 };
 
 
+/** Registers a command line option which changes the code generated by
+ *  the conversion. The values of the registered options are part of the
+ *  key of the function cache. */
+void registerCodegenOption(llvm::StringRef name, std::function<void (llvm::raw_ostream&)> print);
+/** Prints the name and the value of every registered option, in name order */
+void printCodegenOptions(llvm::raw_ostream& stm);
+
+/** A cl::opt which registers itself with registerCodegenOption() */
+template <class DataType>
+class CodegenOpt : public llvm::cl::opt<DataType> {
+public:
+  template <class... Mods>
+  explicit CodegenOpt(const Mods&... ms) : llvm::cl::opt<DataType>(ms...) {
+    registerCodegenOption(this->ArgStr, [this](llvm::raw_ostream& stm) {
+      stm << this->getValue();
+    });
+  }
+};
+
+
 struct FloatToFixed : public llvm::ModulePass {
   static char ID;
   FixedPointType defaultFixpType;
   
-  /** Map from original values to converted values.
-   *  Values not to be converted do not appear in the map.
+  /** Dense number of each value of the conversion queue, assigned once
+   *  the queue is final by numberQueuedValues(). Indexes operandPool
+   *  and info, and equals the position of the value in the queue, which
+   *  the passes over the queue use directly instead of this map. */
+  llvm::DenseMap<llvm::Value *, unsigned> valueNumbers;
+  
+  /** Converted value of each numbered value.
+   *  Values not (yet) converted are mapped to null.
    *  Values which have not been converted successfully are mapped to
-   *  one of two sentinel values, ConversionError or Unsupported. */
-  llvm::DenseMap<llvm::Value *, llvm::Value *> operandPool;
+   *  one of two sentinel values, ConversionError or Unsupported.
+   *  To not be accessed directly, use convertedValue(). */
+  std::vector<llvm::Value *> operandPool;
+  /** Converted values of the values which are not numbered, such as
+   *  placeholders and values created during the conversion */
+  llvm::DenseMap<llvm::Value *, llvm::Value *> unnumberedOperandPool;
+  
+  /** Map from original function (as cloned by Initializer) and fixed point
+   *  signature to function cloned by this pass in order to change argument
+   *  and return values. Each signature gets its own specialized clone. */
+  std::map<std::pair<llvm::Function*, FixedPointSignature>, llvm::Function*> functionPool;
+  
+  /** Functions cloned by Initializer. Their body is never converted in place,
+   *  only through the clones created by createFixFun. */
+  llvm::SmallPtrSet<llvm::Function*, 16> templateFunctions;
   
-  /** Map from original function (as cloned by Initializer)
-   *  to function cloned by this pass in order to change argument
-   *  and return values */
-  llvm::DenseMap<llvm::Function*, llvm::Function*> functionPool;
+  /** Map from call instructions to the function clone they shall call
+   *  once converted */
+  llvm::DenseMap<llvm::Instruction*, llvm::Function*> callTargets;
+  
+  /** Roots of the data flows, by id, and the id of each root */
+  std::vector<llvm::Value *> rootValues;
+  llvm::DenseMap<llvm::Value *, unsigned> rootIds;
+  unsigned getRootId(llvm::Value *root) {
+    auto id = rootIds.insert({root, (unsigned)rootValues.size()});
+    if (id.second)
+      rootValues.push_back(root);
+    return id.first->second;
+  }
   
   /* to not be accessed directly, use valueInfo() */
-  llvm::DenseMap<llvm::Value *, std::shared_ptr<ValueInfo>> info;
+  std::vector<ValueInfo *> info;
+  /** ValueInfo of the values which are not numbered */
+  llvm::DenseMap<llvm::Value *, ValueInfo *> unnumberedInfo;
+  /** Backing storage of all the ValueInfo objects referenced by info.
+   *  Released all at once by releaseValueInfo(). */
+  llvm::SpecificBumpPtrAllocator<ValueInfo> valueInfoAllocator;
+  
+  /** Placeholders of the phis being converted, in creation order.
+   *  Phis removed from the queue leave a tombstone (null phi). */
+  std::vector<std::pair<llvm::PHINode *, PHIInfo>> phiReplacementData;
+  /** Position of each phi in phiReplacementData */
+  llvm::DenseMap<llvm::PHINode *, unsigned> phiReplacementIndex;
   
-  llvm::ValueMap<llvm::PHINode *, PHIInfo> phiReplacementData;
+  /** Provides the LoopInfo of a function. Set by the pass manager
+   *  driving the conversion (see runOnModule() and FloatToFixedPass). */
+  std::function<llvm::LoopInfo& (llvm::Function&)> getLoopInfo;
+  /** Loop depth of the basic blocks of the functions examined so far */
+  llvm::DenseMap<llvm::BasicBlock *, unsigned> loopDepthCache;
+  /** Loops of the functions examined so far, identified by their
+   *  position in the vector, with the terminator of their preheader (null
+   *  if the loop has no preheader) and their parent loop (-1 if none). */
+  struct LoopNestItem {
+    llvm::Instruction *preheaderTerm;
+    int parent;
+  };
+  std::vector<LoopNestItem> loopNest;
+  /** Innermost loop of the basic blocks of the functions examined so far
+   *  (-1 if not in a loop) */
+  llvm::DenseMap<llvm::BasicBlock *, int> innermostLoopCache;
+  int getInnermostLoop(llvm::BasicBlock *bb);
+  /** Provides the BlockFrequencyInfo of a function, like getLoopInfo.
+   *  Only available when isConversionPlanningEnabled(). */
+  std::function<llvm::BlockFrequencyInfo& (llvm::Function&)> getBlockFrequencyInfo;
+  /** Discards the analysis results of a function before it is erased.
+   *  Set by the pass manager driving the conversion, like getLoopInfo. */
+  std::function<void (llvm::Function&)> releaseFunctionAnalyses;
+  /** Frequency of the basic blocks of the functions examined so far,
+   *  relative to the entry block */
+  llvm::DenseMap<llvm::BasicBlock *, double> blockFreqCache;
+  double getBlockFrequency(llvm::BasicBlock *bb);
+  
+  /** Per-function conversion timers, reported with -time-passes when
+   *  the pass is destroyed. */
+  std::unique_ptr<llvm::TimerGroup> functionTimerGroup;
+  llvm::DenseMap<llvm::Function *, std::unique_ptr<llvm::Timer>> functionTimers;
+  llvm::Timer *getFunctionTimer(llvm::Function *f);
+  /** Updates the statistics about the peak memory usage of the
+   *  main tables of the pass. */
+  void recordMemoryUsage();
+  /** Wall time of each phase of the last conversion, in seconds */
+  std::vector<std::pair<std::string, double>> phaseTimes;
+  struct MemoryPeak {
+    size_t entries = 0;
+    size_t bytes = 0;
+    void update(size_t e, size_t b) { entries = std::max(entries, e); bytes = std::max(bytes, b); }
+  };
+  MemoryPeak infoPeak, operandPoolPeak, functionPoolPeak, phiDataPeak;
+  /** Appends the phase times and the peak table sizes of the conversion
+   *  of a module to the file given with -flttofix-report, as one JSON object
+   *  per line. */
+  void writeReport(llvm::Module& m, size_t numValues, size_t numQueued);
   
   FloatToFixed(): ModulePass(ID) { };
   void getAnalysisUsage(llvm::AnalysisUsage &) const override;
   bool runOnModule(llvm::Module &M) override;
-
-  void readGlobalMetadata(llvm::Module &m, llvm::SmallPtrSetImpl<llvm::Value *> &res, bool functionAnnotation = false);
-  void readLocalMetadata(llvm::Function &f, llvm::SmallPtrSetImpl<llvm::Value *> &res, bool onlyArguments = false);
-  void readAllLocalMetadata(llvm::Module &m, llvm::SmallPtrSetImpl<llvm::Value *> &res);
-  bool parseMetaData(llvm::SmallPtrSetImpl<llvm::Value *> *variables, mdutils::MDInfo *fpInfo, llvm::Value *instr);
-  void removeNoFloatTy(llvm::SmallPtrSetImpl<llvm::Value *>& res);
+  /** Performs the conversion of a whole module.
+   *  @returns true if the module was modified. */
+  bool convertModule(llvm::Module &M);
+
+  void readGlobalMetadata(llvm::Module &m, llvm::SetVector<llvm::Value *> &res, bool functionAnnotation = false);
+  void readLocalMetadata(llvm::Function &f, llvm::SetVector<llvm::Value *> &res, bool onlyArguments = false);
+  void readAllLocalMetadata(llvm::Module &m, llvm::SetVector<llvm::Value *> &res);
+  void readAllLocalMetadataParallel(llvm::Module &m, llvm::SetVector<llvm::Value *> &res);
+  bool parseMetaData(llvm::SetVector<llvm::Value *> *variables, mdutils::MDInfo *fpInfo, llvm::Value *instr);
+  /** Builds the ValueInfo of a value from its metadata without touching
+   *  the state of the pass; safe to call concurrently.
+   *  @returns false if the value shall not be converted. */
+  static bool buildValueInfo(mdutils::MDInfo *fpInfo, llvm::Value *instr, ValueInfo& vi);
+  void removeNoFloatTy(llvm::SetVector<llvm::Value *>& res);
+  
+  /** MDInfo decoded from each metadata node seen so far */
+  llvm::DenseMap<llvm::MDNode *, mdutils::MDInfo *> mdInfoCache;
+  /** Same as MetadataManager::retrieveMDInfo, but decodes each metadata
+   *  node only once. */
+  mdutils::MDInfo *retrieveMDInfo(llvm::Value *v);
+  /** ValueInfo of the annotated instructions of the body of each template
+   *  function, shared by all of its clones. */
+  llvm::DenseMap<llvm::Function *, std::vector<std::pair<llvm::Instruction *, ValueInfo>>> templateBodyInfo;
+  const std::vector<std::pair<llvm::Instruction *, ValueInfo>>& readTemplateMetadata(llvm::Function &f);
   void printAnnotatedObj(llvm::Module &m);
   
   void openPhiLoop(llvm::PHINode *phi);
   void closePhiLoops();
   void sortQueue(std::vector<llvm::Value*> &vals);
   void cleanup(const std::vector<llvm::Value*>& queue);
-  void propagateCall(std::vector<llvm::Value *> &vals, llvm::SmallPtrSetImpl<llvm::Value *> &global);
-  llvm::Function *createFixFun(llvm::CallSite* call, bool *old);
-  void printConversionQueue(std::vector<llvm::Value*> vals);
+  void propagateCall(std::vector<llvm::Value *> &vals, llvm::SetVector<llvm::Value *> &global);
+  static bool isConversionPlanningEnabled();
+  /** Removes from the queue the regions of connected values whose
+   *  conversions from and to floating point, weighted by the block
+   *  frequencies, are estimated to cost more than what is gained by
+   *  converting their floating point operations. */
+  void planConversion(std::vector<llvm::Value *> &vals);
+  llvm::Function *createFixFun(llvm::CallSite* call, bool *old, FixedPointSignature *signature = nullptr);
+  /** Computes the fixed point signature of the function called by a call
+   *  site. The format of each argument is the one of the actual argument
+   *  when it is converted, otherwise the one of the formal argument. */
+  void getFixedPointSignature(llvm::CallSite *call, FixedPointSignature& fixArgs);
+  /** Removes the clones of the same function which turned out to be
+   *  identical after the conversion. */
+  void mergeIdenticalClones(llvm::Module& m);
+  
+  /** Converted function clones which can be saved to the persistent
+   *  cache at the end of the conversion, with their cache key. */
+  std::vector<std::pair<llvm::Function *, std::string>> cacheableClones;
+  bool isFunctionCacheEnabled();
+  bool isCacheableFunction(llvm::Function *oldF);
+  std::string getFunctionCacheKey(llvm::ModuleSlotTracker& mst, llvm::Function *oldF, llvm::Function *newF,
+    const FixedPointSignature& fixArgs);
+  bool loadCachedFunction(llvm::Function *newF, const std::string& key);
+  void saveCachedFunctions();
+  /** Prints the conversion queue as one JSON object per value, with the
+   *  outcome of the conversion found in operandPool. The roots of a value
+   *  are identified by their position in the queue. */
+  void printConversionQueue(llvm::Module& m, llvm::raw_ostream& out, const std::vector<llvm::Value*>& vals);
+  /** Writes the conversion queue to the file given with -flttofix-dump-queue */
+  void dumpConversionQueue(llvm::Module& m, const std::vector<llvm::Value*>& vals);
   void performConversion(llvm::Module& m, std::vector<llvm::Value*>& q);
   llvm::Value *convertSingleValue(llvm::Module& m, llvm::Value *val, FixedPointType& fixpt);
   
+  /** Fixed point math runtime loaded from -flttofix-math-runtime, and the
+   *  names of its functions called by the converted code */
+  std::unique_ptr<llvm::Module> mathRuntime;
+  bool mathRuntimeLoadFailed = false;
+  std::set<std::string> mathRuntimeUsed;
+  /** Returns if a call to a libm function or intrinsic shall be replaced
+   *  by a call to the fixed point math runtime. */
+  bool isMathRuntimeCall(llvm::CallSite *call);
+  /** Returns the declaration of the runtime function implementing an
+   *  elementary function for signed fixed point values of the given width.
+   *  The runtime is loaded and verified the first time.
+   *  @returns nullptr if the runtime is not available, does not implement
+   *    the function with the expected type, or clashes with the module. */
+  llvm::Function *getMathRuntimeFunction(llvm::Module& m, llvm::StringRef name, unsigned width);
+  /** Links the used runtime functions into the module. A failure is a
+   *  fatal error, as the calls to the runtime are already in place. */
+  void linkMathRuntime(llvm::Module& m);
+  
+  /** Placeholders created so far, erased by cleanup() */
+  std::vector<llvm::WeakVH> placeholders;
   llvm::Value *createPlaceholder(llvm::Type *type, llvm::BasicBlock *where, llvm::StringRef name);
   
   enum class TypeMatchPolicy {
@@ -146,12 +372,71 @@ struct FloatToFixed : public llvm::ModulePass {
   llvm::Value *convertStore(llvm::StoreInst *load);
   llvm::Value *convertGep(llvm::GetElementPtrInst *gep, FixedPointType& fixpt);
   llvm::Value *convertExtractValue(llvm::ExtractValueInst *exv, FixedPointType& fixpt);
+  llvm::Value *convertExtractElement(llvm::ExtractElementInst *exe, FixedPointType& fixpt);
+  llvm::Value *convertInsertElement(llvm::InsertElementInst *ine, FixedPointType& fixpt);
+  llvm::Value *convertShuffleVector(llvm::ShuffleVectorInst *shuf, FixedPointType& fixpt);
+  llvm::Value *convertMaskedLoad(llvm::IntrinsicInst *load, FixedPointType& fixpt);
+  llvm::Value *convertMaskedStore(llvm::IntrinsicInst *store);
+  /** Converts the intrinsics operating on floating point values which have
+   *  a direct fixed point equivalent (fabs, fma, fmuladd, minnum, maxnum,
+   *  copysign, floor, ceil, trunc, round).
+   *  @returns Unsupported for any other intrinsic. */
+  llvm::Value *convertFloatIntrinsic(llvm::IntrinsicInst *intr, FixedPointType& fixpt);
+  llvm::Value *genFixedPointNeg(llvm::Value *val, const FixedPointType& fixpt, llvm::Instruction *ip, bool saturate);
+  llvm::Value *genFixedPointAbs(llvm::Value *val, const FixedPointType& fixpt, llvm::Instruction *ip, bool saturate);
   llvm::Value *convertInsertValue(llvm::InsertValueInst *inv, FixedPointType& fixpt);
   llvm::Value *convertPhi(llvm::PHINode *load, FixedPointType& fixpt);
   llvm::Value *convertSelect(llvm::SelectInst *sel, FixedPointType& fixpt);
   llvm::Value *convertCall(llvm::CallSite *call, FixedPointType& fixpt);
+  /** Replaces a call to sqrt, exp, log, sin or cos by a call to the
+   *  fixed point math runtime. */
+  llvm::Value *convertMathCall(llvm::CallSite *call, FixedPointType& fixpt);
   llvm::Value *convertRet(llvm::ReturnInst *ret, FixedPointType& fixpt);
+  llvm::Value *convertUnaryOp(llvm::UnaryOperator *instr, const FixedPointType& fixpt);
   llvm::Value *convertBinOp(llvm::Instruction *instr, const FixedPointType& fixpt);
+  /** Generates a fixed point multiplication computed at double width.
+   *  @returns The product converted to fixpt. */
+  llvm::Value *genFixedPointMul(llvm::Instruction *instr, llvm::Value *val1, const FixedPointType& intype1,
+    llvm::Value *val2, const FixedPointType& intype2, const FixedPointType& fixpt);
+  /** Generates a fixed point multiplication computed at double width,
+   *  without converting the product to the destination format.
+   *  @param intermtype Set to the format of the product. */
+  llvm::Value *genWideFixedPointMul(llvm::Instruction *instr, llvm::Value *val1, const FixedPointType& intype1,
+    llvm::Value *val2, const FixedPointType& intype2, bool sign, FixedPointType& intermtype);
+  /** Generates the multiplication of op by 2^exp, which requires at most
+   *  one shift as it only changes the fixed point format of op.
+   *  @returns The product converted to fixpt, or null if the operand
+   *    cannot be converted or the exponent is too large for the shift to
+   *    fit in the value; the generic operation is used instead. */
+  llvm::Value *genFixedPointScaleByPowerOf2(llvm::Instruction *instr, llvm::Value *op, int exp,
+    const FixedPointType& fixpt);
+  /** Returns the fixed point reciprocal of a floating point constant (or
+   *  splat vector constant) divisor, computed exactly from the value of the
+   *  divisor and rounded to nearest. It has the width of fixpt and as many
+   *  fractional bits as possible.
+   *  @param recipt Set to the format of the reciprocal.
+   *  @returns The reciprocal, or nullptr if the divisor is not such a
+   *    constant or its reciprocal is not representable. */
+  llvm::Constant *getConstantReciprocal(llvm::Value *divisor, const FixedPointType& fixpt, FixedPointType& recipt);
+  /** Generates a llvm.[su]mul.fix or llvm.[su]div.fix intrinsic call
+   *  replacing a FMul or FDiv instruction.
+   *  @returns nullptr if the formats of the operands cannot be handled
+   *    by the intrinsic. */
+  llvm::Value *genFixedPointIntrinsic(llvm::Instruction *instr, llvm::Value *val1, const FixedPointType& intype1,
+    llvm::Value *val2, const FixedPointType& intype2, const FixedPointType& fixpt, bool saturate = false);
+  /** Returns if the fixed point code generated for an instruction shall
+   *  saturate instead of wrapping around on overflow. Enabled for all
+   *  instructions by -flttofix-saturate, or by SATURATE_METADATA attached to
+   *  the instruction or to its function. */
+  bool isSaturating(llvm::Instruction *i);
+  /** Converts a comparison between a value and a floating point constant
+   *  by rescaling the constant to the format of the value.
+   *  @returns nullptr if none of the operands is a constant. */
+  llvm::Value *convertCmpWithConstant(llvm::FCmpInst *fcmp);
+  /** Returns if all the values of val, whose format is srct, can be
+   *  represented in the format destt, according to srct or to the range
+   *  of val. */
+  bool fitsInFixedPointType(llvm::Value *val, const FixedPointType& srct, const FixedPointType& destt);
   llvm::Value *convertCmp(llvm::FCmpInst *fcmp);
   llvm::Value *convertCast(llvm::CastInst *cast, const FixedPointType& fixpt);
   llvm::Value *fallback(llvm::Instruction *unsupp, FixedPointType& fixpt);
@@ -170,7 +455,7 @@ struct FloatToFixed : public llvm::ModulePass {
    *    the converted value if the original value was converted,
    *    or the original value itself if it does not require conversion. */
   llvm::Value *matchOp(llvm::Value *val) {
-    llvm::Value *res = operandPool[val];
+    llvm::Value *res = convertedValue(val);
     return res == ConversionError ? nullptr : (res ? res : val);
   };
 
@@ -211,7 +496,7 @@ struct FloatToFixed : public llvm::ModulePass {
    *    val was to be converted but its conversion failed. */
   llvm::Value *translateOrMatchAnyOperand(llvm::Value *val, FixedPointType& iofixpt, llvm::Instruction *ip = nullptr, TypeMatchPolicy typepol = TypeMatchPolicy::RangeOverHintMaxFrac) {
     llvm::Value *res;
-    if (val->getType()->getNumContainedTypes() > 0) {
+    if (val->getType()->getNumContainedTypes() > 0 && !val->getType()->isVectorTy()) {
       if (llvm::Constant *cst = llvm::dyn_cast<llvm::Constant>(val)) {
         res = convertConstant(cst, iofixpt, typepol);
       } else {
@@ -262,7 +547,7 @@ struct FloatToFixed : public llvm::ModulePass {
   };
   
   llvm::Value *fallbackMatchValue(llvm::Value *fallval, llvm::Type *origType, llvm::Instruction *ip = nullptr) {
-    llvm::Value *cvtfallval = operandPool[fallval];
+    llvm::Value *cvtfallval = convertedValue(fallval);
     
     if (cvtfallval == ConversionError) {
       LLVM_DEBUG(llvm::dbgs() << "error: bail out reverse match of " << *fallval << "\n");
@@ -289,7 +574,7 @@ struct FloatToFixed : public llvm::ModulePass {
       bc->insertBefore(ip);
       return bc;
     }
-    if (origType->isFloatingPointTy())
+    if (origType->isFPOrFPVectorTy())
       return genConvertFixToFloat(cvtfallval, fixPType(cvtfallval), origType);
     return cvtfallval;
   }
@@ -324,6 +609,25 @@ struct FloatToFixed : public llvm::ModulePass {
    *    is an instruction or a constant.
    *  @returns The converted value. */
   llvm::Value *genConvertFixedToFixed(llvm::Value *fix, const FixedPointType& srct, const FixedPointType& destt, llvm::Instruction *ip = nullptr);
+  /** Source value, format of the source (null for floating point values),
+   *  destination format and saturation of a conversion */
+  typedef std::tuple<llvm::Value *, const void *, const void *, bool> ConversionCacheKey;
+  /** Last conversion generated for each key */
+  std::map<ConversionCacheKey, llvm::WeakVH> conversionCache;
+  /** Dominator trees of the functions examined so far */
+  llvm::DenseMap<llvm::Function *, std::unique_ptr<llvm::DominatorTree>> domTreeCache;
+  llvm::DominatorTree& getDominatorTree(llvm::Function *f);
+  /** Returns a previously generated conversion which dominates ip, if any.
+   *  Otherwise, if a previous conversion exists, convip is moved to a
+   *  position which dominates both the previous conversion and ip.
+   *  @param convip The position where the new conversion would be placed. */
+  llvm::Value *findCachedConversion(const ConversionCacheKey& key, llvm::Instruction *ip, llvm::Instruction *&convip);
+  void cacheConversion(const ConversionCacheKey& key, llvm::Value *res);
+  /** Returns where the conversion of a value used by ip shall be inserted:
+   *  the preheader of the outermost loop containing ip where the value is
+   *  invariant, or ip itself if the value is not invariant in the loop
+   *  containing ip. */
+  llvm::Instruction *getHoistedInsertionPoint(llvm::Value *v, llvm::Instruction *ip);
 
   /** Transforms a pre-existing LLVM type to a new LLVM
    *  type with integers instead of floating point depending on a
@@ -349,53 +653,117 @@ struct FloatToFixed : public llvm::ModulePass {
   
   llvm::Type *getLLVMFixedPointTypeForFloatValue(llvm::Value *val);
   
-  std::shared_ptr<ValueInfo> newValueInfo(llvm::Value *val) {
-    LLVM_DEBUG(llvm::dbgs() << "new valueinfo for " << *val << "\n");
-    auto vi = info.find(val);
-    if (vi == info.end()) {
-      info[val] = std::make_shared<ValueInfo>(ValueInfo());
-      return info[val];
-    } else {
-      assert(false && "value already has info!");
+  /** Assigns a dense number to each value of the final conversion queue
+   *  and moves their ValueInfo and converted value from the side maps to
+   *  the info and operandPool vectors. The annotation calls and the
+   *  duplicates are removed from the queue, so that afterwards the number
+   *  of each value is its position in the queue. */
+  void numberQueuedValues(std::vector<llvm::Value *>& q);
+  /** Returns the info slot of val, or null if val has no entry and
+   *  create is false. */
+  ValueInfo **valueInfoSlot(llvm::Value *val, bool create) {
+    auto n = valueNumbers.find(val);
+    if (n != valueNumbers.end())
+      return &info[n->second];
+    if (!create) {
+      auto vi = unnumberedInfo.find(val);
+      return vi != unnumberedInfo.end() ? &vi->second : nullptr;
     }
+    return &unnumberedInfo[val];
   }
-  std::shared_ptr<ValueInfo> demandValueInfo(llvm::Value *val, bool *isNew = nullptr) {
-    LLVM_DEBUG(llvm::dbgs() << "new valueinfo for " << *val << "\n");
-    auto vi = info.find(val);
-    if (vi == info.end()) {
-      if (isNew) *isNew = true;
-      info[val] = std::make_shared<ValueInfo>(ValueInfo());
-      return info[val];
-    } else {
-      if (isNew) *isNew = false;
-      return vi->getSecond();
+  llvm::Value *convertedValue(llvm::Value *val) const {
+    auto n = valueNumbers.find(val);
+    if (n != valueNumbers.end())
+      return operandPool[n->second];
+    return unnumberedOperandPool.lookup(val);
+  }
+  /** Same as convertedValue(), also returning the info of val (null if
+   *  none) with a single lookup */
+  llvm::Value *convertedValue(llvm::Value *val, ValueInfo *&vi) const {
+    auto n = valueNumbers.find(val);
+    if (n != valueNumbers.end()) {
+      vi = info[n->second];
+      return operandPool[n->second];
     }
+    vi = unnumberedInfo.lookup(val);
+    return unnumberedOperandPool.lookup(val);
   }
-  std::shared_ptr<ValueInfo> valueInfo(llvm::Value *val) {
-    auto vi = info.find(val);
-    assert((vi != info.end()) && "value with no info");
-    return vi->getSecond();
+  void setConvertedValue(llvm::Value *val, llvm::Value *newv) {
+    auto n = valueNumbers.find(val);
+    if (n != valueNumbers.end())
+      operandPool[n->second] = newv;
+    else
+      unnumberedOperandPool[val] = newv;
+  }
+  
+  ValueInfo *newValueInfo(llvm::Value *val) {
+    LLVM_DEBUG(llvm::dbgs() << "new valueinfo for " << *val << "\n");
+    ValueInfo **vi = valueInfoSlot(val, true);
+    assert(!*vi && "value already has info!");
+    *vi = new (valueInfoAllocator.Allocate()) ValueInfo();
+    return *vi;
+  }
+  ValueInfo *demandValueInfo(llvm::Value *val, bool *isNew = nullptr) {
+    LLVM_DEBUG(llvm::dbgs() << "new valueinfo for " << *val << "\n");
+    ValueInfo **vi = valueInfoSlot(val, true);
+    if (isNew) *isNew = !*vi;
+    if (!*vi)
+      *vi = new (valueInfoAllocator.Allocate()) ValueInfo();
+    return *vi;
+  }
+  ValueInfo *valueInfo(llvm::Value *val) {
+    ValueInfo **vi = valueInfoSlot(val, false);
+    assert(vi && *vi && "value with no info");
+    return *vi;
   };
   FixedPointType& fixPType(llvm::Value *val) {
-    auto vi = info.find(val);
-    assert((vi != info.end()) && "value with no info");
-    return vi->getSecond()->fixpType;
+    return valueInfo(val)->fixpType;
   };
   bool hasInfo(llvm::Value *val) {
-    return info.find(val) != info.end();
+    ValueInfo **vi = valueInfoSlot(val, false);
+    return vi && *vi;
   };
+  /** Removes the info and the converted value of val */
+  void eraseValue(llvm::Value *val) {
+    auto n = valueNumbers.find(val);
+    if (n != valueNumbers.end()) {
+      info[n->second] = nullptr;
+      operandPool[n->second] = nullptr;
+    } else {
+      unnumberedInfo.erase(val);
+      unnumberedOperandPool.erase(val);
+    }
+  }
+  /** Destroys all the ValueInfo objects at once and forgets the value
+   *  numbers. Every pointer previously returned by valueInfo() becomes
+   *  dangling. */
+  void releaseValueInfo() {
+    valueNumbers.clear();
+    info.clear();
+    operandPool.clear();
+    unnumberedInfo.clear();
+    unnumberedOperandPool.clear();
+    rootValues.clear();
+    rootIds.clear();
+    valueInfoAllocator.DestroyAll();
+  }
   
+  /** Same as taffo::isFloatType, but also true for (pointers to) vectors
+   *  of floating point values */
+  static bool isFloatOrFloatVectorType(llvm::Type *ty) {
+    return taffo::fullyUnwrapPointerOrArrayType(ty)->isFPOrFPVectorTy() || taffo::isFloatType(ty);
+  }
   bool isConvertedFixedPoint(llvm::Value *val) {
     if (!hasInfo(val))
       return false;
-    std::shared_ptr<ValueInfo> vi = valueInfo(val);
+    ValueInfo *vi = valueInfo(val);
     if (vi->noTypeConversion)
       return false;
     if (vi->fixpType.isInvalid())
       return false;
     llvm::Type *fuwt = taffo::fullyUnwrapPointerOrArrayType(vi->origType);
     if (!fuwt->isStructTy()) {
-      if (!taffo::isFloatType(vi->origType))
+      if (!isFloatOrFloatVectorType(vi->origType))
         return false;
     }
     if (val->getType() == vi->origType)
@@ -412,7 +780,7 @@ struct FloatToFixed : public llvm::ModulePass {
       return false;
     if (!hasInfo(val))
       return false;
-    std::shared_ptr<ValueInfo> vi = valueInfo(val);
+    ValueInfo *vi = valueInfo(val);
     if (vi->noTypeConversion)
       return false;
     if (vi->fixpType.isInvalid())
@@ -424,7 +792,7 @@ struct FloatToFixed : public llvm::ModulePass {
       ty = val->getType();
     llvm::Type *fuwt = taffo::fullyUnwrapPointerOrArrayType(ty);
     if (!fuwt->isStructTy()) {
-      if (!taffo::isFloatType(ty))
+      if (!isFloatOrFloatVectorType(ty))
         return false;
     }
     return true;
@@ -524,6 +892,23 @@ struct FloatToFixed : public llvm::ModulePass {
 };
 
 
+/** Float to fixed point conversion pass for the new pass manager.
+ *  The CFG of every function is left untouched, therefore CFG-only
+ *  analyses are preserved. */
+struct FloatToFixedPass : public llvm::PassInfoMixin<FloatToFixedPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+/** Makes the "flttofix" pass name available to the new pass manager
+ *  pipeline parser. Called by the plugin entry point llvmGetPassPluginInfo,
+ *  or directly by tools which link the pass statically. */
+void registerFloatToFixedPass(llvm::PassBuilder &PB);
+
+/** Returns the peak resident set size of the process in bytes, or 0 if it
+ *  is not available on the host. */
+size_t getPeakResidentSetSize();
+
+
 }
 
 
@@ -5,9 +5,13 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/ThreadPool.h"
 #include "LLVMFloatToFixedPass.h"
 #include "TypeUtils.h"
 #include "Metadata.h"
@@ -19,12 +23,16 @@ using namespace mdutils;
 using namespace taffo;
 
 
-void FloatToFixed::readGlobalMetadata(Module &m, SmallPtrSetImpl<Value *> &variables, bool functionAnnotation)
+static cl::opt<unsigned> MetadataReadThreads("flttofix-md-threads",
+  cl::desc("Number of threads used for reading the metadata of the functions "
+    "in the module (1 = read serially)"),
+  cl::init(1));
+
+
+void FloatToFixed::readGlobalMetadata(Module &m, SetVector<Value *> &variables, bool functionAnnotation)
 {
-  MetadataManager &MDManager = MetadataManager::getMetadataManager();
-  
   for (GlobalVariable &gv : m.globals()) {
-    MDInfo *MDI = MDManager.retrieveMDInfo(&gv);
+    MDInfo *MDI = retrieveMDInfo(&gv);
     if (MDI) {
       parseMetaData(&variables, MDI, &gv);
     }
@@ -34,7 +42,7 @@ void FloatToFixed::readGlobalMetadata(Module &m, SmallPtrSetImpl<Value *> &varia
 }
 
 
-void FloatToFixed::readLocalMetadata(Function &f, SmallPtrSetImpl<Value *> &variables, bool argumentsOnly)
+void FloatToFixed::readLocalMetadata(Function &f, SetVector<Value *> &variables, bool argumentsOnly)
 {
   MetadataManager &MDManager = MetadataManager::getMetadataManager();
 
@@ -54,7 +62,7 @@ void FloatToFixed::readLocalMetadata(Function &f, SmallPtrSetImpl<Value *> &vari
     return;
 
   for (inst_iterator iIt = inst_begin(&f), iItEnd = inst_end(&f); iIt != iItEnd; iIt++) {
-    MDInfo *MDI = MDManager.retrieveMDInfo(&(*iIt));
+    MDInfo *MDI = retrieveMDInfo(&(*iIt));
     if (MDI) {
       parseMetaData(&variables, MDI, &(*iIt));
     }
@@ -62,17 +70,22 @@ void FloatToFixed::readLocalMetadata(Function &f, SmallPtrSetImpl<Value *> &vari
 }
 
 
-void FloatToFixed::readAllLocalMetadata(Module &m, SmallPtrSetImpl<Value *> &res)
+void FloatToFixed::readAllLocalMetadata(Module &m, SetVector<Value *> &res)
 {
+  if (MetadataReadThreads > 1) {
+    readAllLocalMetadataParallel(m, res);
+    return;
+  }
+  
   for (Function &f: m.functions()) {
     bool argsOnly = false;
     if (f.getMetadata(SOURCE_FUN_METADATA)) {
       LLVM_DEBUG(dbgs() << __FUNCTION__ << " skipping function body of " << f.getName() << " because it is cloned\n");
-      functionPool[&f] = nullptr;
+      templateFunctions.insert(&f);
       argsOnly = true;
     }
     
-    SmallPtrSet<Value*, 32> t;
+    SetVector<Value *> t;
     readLocalMetadata(f, t, argsOnly);
     res.insert(t.begin(), t.end());
 
@@ -83,10 +96,201 @@ void FloatToFixed::readAllLocalMetadata(Module &m, SmallPtrSetImpl<Value *> &res
 }
 
 
-bool FloatToFixed::parseMetaData(SmallPtrSetImpl<Value *> *variables, MDInfo *raw, Value *instr)
+void FloatToFixed::readAllLocalMetadataParallel(Module &m, SetVector<Value *> &res)
+{
+  /* The caches of the MetadataManager are not thread safe. Therefore the
+   * metadata nodes are decoded by the MetadataManager one call at a time,
+   * exactly like in the serial path, and each task decodes every node only
+   * once thanks to a cache local to the task; the results are merged in
+   * mdInfoCache afterwards. The scan of the instructions and the
+   * construction of the ValueInfo objects run in parallel. */
+  struct LocalMetadataEntry {
+    Value *val;
+    ValueInfo vi;
+    bool enqueue;
+  };
+  struct FunctionMetadata {
+    Function *fun;
+    bool argsOnly;
+    std::vector<LocalMetadataEntry> entries;
+  };
+  struct Task {
+    std::vector<FunctionMetadata *> funcs;
+    DenseMap<MDNode *, MDInfo *> decoded;
+  };
+  
+  std::vector<FunctionMetadata> funcs;
+  size_t totalSize = 0;
+  for (Function &f: m.functions()) {
+    bool argsOnly = f.getMetadata(SOURCE_FUN_METADATA) != nullptr;
+    funcs.push_back({&f, argsOnly, {}});
+    if (!argsOnly)
+      totalSize += f.getInstructionCount();
+  }
+  
+  /* split the functions in contiguous groups of similar size, a few per
+   * thread to balance the load */
+  std::vector<Task> tasks(1);
+  size_t taskSize = 0;
+  size_t maxTaskSize = totalSize / (MetadataReadThreads * 4) + 1;
+  for (FunctionMetadata& fmd: funcs) {
+    if (taskSize >= maxTaskSize) {
+      tasks.emplace_back();
+      taskSize = 0;
+    }
+    tasks.back().funcs.push_back(&fmd);
+    if (!fmd.argsOnly)
+      taskSize += fmd.fun->getInstructionCount();
+  }
+  
+  /* looking up the kind by name is not thread safe */
+  unsigned infoKind = m.getContext().getMDKindID(INPUT_INFO_METADATA);
+  unsigned structKind = m.getContext().getMDKindID(STRUCT_INFO_METADATA);
+  MetadataManager &MDManager = MetadataManager::getMetadataManager();
+  sys::Mutex mdManagerLock;
+  
+  ThreadPool pool(MetadataReadThreads);
+  for (Task& task: tasks) {
+    pool.async([&MDManager, &mdManagerLock, &task, infoKind, structKind]() {
+      auto decode = [&](Instruction& inst) -> MDInfo* {
+        MDNode *md = inst.getMetadata(infoKind);
+        if (!md)
+          md = inst.getMetadata(structKind);
+        if (!md)
+          return nullptr;
+        auto cached = task.decoded.find(md);
+        if (cached != task.decoded.end())
+          return cached->second;
+        
+        MDInfo *MDI;
+        {
+          sys::ScopedLock guard(mdManagerLock);
+          MDI = MDManager.retrieveMDInfo(&inst);
+        }
+        task.decoded[md] = MDI;
+        return MDI;
+      };
+      
+      for (FunctionMetadata *fmd: task.funcs) {
+        Function &f = *fmd->fun;
+        auto addEntry = [&](MDInfo *MDI, Value *v, bool enqueue) {
+          LocalMetadataEntry e = {v, ValueInfo(), enqueue};
+          if (buildValueInfo(MDI, v, e.vi))
+            fmd->entries.push_back(std::move(e));
+        };
+        
+        SmallVector<mdutils::MDInfo*, 5> argsII;
+        {
+          sys::ScopedLock guard(mdManagerLock);
+          MDManager.retrieveArgumentInputInfo(f, argsII);
+        }
+        auto arg = f.arg_begin();
+        for (auto itII = argsII.begin(); itII != argsII.end(); itII++) {
+          if (*itII != nullptr)
+            addEntry(*itII, arg, false);
+          arg++;
+        }
+        
+        if (fmd->argsOnly)
+          continue;
+        
+        for (Instruction &inst: instructions(f)) {
+          if (!inst.hasMetadataOtherThanDebugLoc())
+            continue;
+          if (MDInfo *MDI = decode(inst))
+            addEntry(MDI, &inst, true);
+        }
+      }
+    });
+  }
+  pool.wait();
+  
+  for (Task& task: tasks) {
+    for (auto& decoded: task.decoded)
+      mdInfoCache.insert(decoded);
+  }
+  
+  for (FunctionMetadata& fmd: funcs) {
+    Function &f = *fmd.fun;
+    if (fmd.argsOnly) {
+      LLVM_DEBUG(dbgs() << __FUNCTION__ << " skipping function body of " << f.getName() << " because it is cloned\n");
+      templateFunctions.insert(&f);
+    }
+    
+    for (LocalMetadataEntry& e: fmd.entries) {
+      if (e.enqueue)
+        res.insert(e.val);
+      *newValueInfo(e.val) = std::move(e.vi);
+    }
+    
+    /* Otherwise dce pass ignore the function
+     * (removed also where it's not required) */
+    f.removeFnAttr(Attribute::OptimizeNone);
+  }
+}
+
+
+MDInfo *FloatToFixed::retrieveMDInfo(Value *v)
+{
+  MDNode *md = nullptr;
+  if (Instruction *inst = dyn_cast<Instruction>(v)) {
+    md = inst->getMetadata(INPUT_INFO_METADATA);
+    if (!md)
+      md = inst->getMetadata(STRUCT_INFO_METADATA);
+  } else if (GlobalObject *obj = dyn_cast<GlobalObject>(v)) {
+    md = obj->getMetadata(INPUT_INFO_METADATA);
+    if (!md)
+      md = obj->getMetadata(STRUCT_INFO_METADATA);
+  } else {
+    return MetadataManager::getMetadataManager().retrieveMDInfo(v);
+  }
+  if (!md)
+    return nullptr;
+  
+  auto cached = mdInfoCache.find(md);
+  if (cached != mdInfoCache.end())
+    return cached->second;
+  MDInfo *res = MetadataManager::getMetadataManager().retrieveMDInfo(v);
+  mdInfoCache[md] = res;
+  return res;
+}
+
+
+const std::vector<std::pair<Instruction *, ValueInfo>>& FloatToFixed::readTemplateMetadata(Function &f)
+{
+  auto cached = templateBodyInfo.find(&f);
+  if (cached != templateBodyInfo.end())
+    return cached->second;
+  
+  std::vector<std::pair<Instruction *, ValueInfo>>& res = templateBodyInfo[&f];
+  for (Instruction &inst: instructions(f)) {
+    MDInfo *MDI = retrieveMDInfo(&inst);
+    if (!MDI)
+      continue;
+    ValueInfo vi;
+    if (buildValueInfo(MDI, &inst, vi))
+      res.push_back(std::make_pair(&inst, std::move(vi)));
+  }
+  return res;
+}
+
+
+bool FloatToFixed::parseMetaData(SetVector<Value *> *variables, MDInfo *raw, Value *instr)
 {
   ValueInfo vi;
+  if (!buildValueInfo(raw, instr, vi))
+    return false;
+
+  if (variables)
+    variables->insert(instr);
+  *newValueInfo(instr) = vi;
+
+  return true;
+}
 
+
+bool FloatToFixed::buildValueInfo(MDInfo *raw, Value *instr, ValueInfo& vi)
+{
   vi.isBacktrackingNode = false;
   vi.fixpTypeRootDistance = 0;
   vi.origType = instr->getType();
@@ -119,17 +323,13 @@ bool FloatToFixed::parseMetaData(SmallPtrSetImpl<Value *> *variables, MDInfo *ra
     assert(false && "MDInfo type unrecognized");
   }
 
-  if (variables)
-    variables->insert(instr);
-  *newValueInfo(instr) = vi;
-
   return true;
 }
 
 
-void FloatToFixed::removeNoFloatTy(SmallPtrSetImpl<Value *> &res)
+void FloatToFixed::removeNoFloatTy(SetVector<Value *> &res)
 {
-  for (auto it: res) {
+  res.remove_if([](Value *it) -> bool {
     Type *ty;
 
     AllocaInst *alloca;
@@ -141,8 +341,7 @@ void FloatToFixed::removeNoFloatTy(SmallPtrSetImpl<Value *> &res)
     } else {
       LLVM_DEBUG(dbgs() << "annotated instruction " << *it <<
         " not an alloca or a global, ignored\n");
-      res.erase(it);
-      continue;
+      return true;
     }
 
     while (ty->isArrayTy() || ty->isPointerTy()) {
@@ -151,12 +350,11 @@ void FloatToFixed::removeNoFloatTy(SmallPtrSetImpl<Value *> &res)
       else
         ty = ty->getArrayElementType();
     }
-    if (!ty->isFloatingPointTy()) {
+    if (!ty->isFPOrFPVectorTy()) {
       LLVM_DEBUG(dbgs() << "annotated instruction " << *it << " does not allocate a"
         " kind of float; ignored\n");
-      res.erase(it);
+      return true;
     }
-  }
+    return false;
+  });
 }
-
-
@@ -0,0 +1,183 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "LLVMFloatToFixedPass.h"
+
+
+using namespace llvm;
+using namespace flttofix;
+
+
+static cl::opt<std::string> MathRuntimeFile("flttofix-math-runtime",
+  cl::desc("Bitcode file of the fixed point math runtime; when specified, "
+    "calls to sqrt, exp, log, sin and cos are replaced by calls to the "
+    "fixed point implementations in the runtime, which is linked into the "
+    "module"),
+  cl::init(""));
+
+
+/** Returns the name of the elementary function computed by a call to a
+ *  libm function or to the equivalent intrinsic, or an empty string if the
+ *  runtime does not implement it. */
+static StringRef getMathFunctionName(const Function *f)
+{
+  switch (f->getIntrinsicID()) {
+    case Intrinsic::sqrt:
+      return "sqrt";
+    case Intrinsic::exp:
+      return "exp";
+    case Intrinsic::log:
+      return "log";
+    case Intrinsic::sin:
+      return "sin";
+    case Intrinsic::cos:
+      return "cos";
+    case Intrinsic::not_intrinsic:
+      break;
+    default:
+      return StringRef();
+  }
+  if (!f->isDeclaration())
+    return StringRef();
+  return StringSwitch<StringRef>(f->getName())
+    .Cases("sqrt", "sqrtf", "sqrt")
+    .Cases("exp", "expf", "exp")
+    .Cases("log", "logf", "log")
+    .Cases("sin", "sinf", "sin")
+    .Cases("cos", "cosf", "cos")
+    .Default(StringRef());
+}
+
+
+bool FloatToFixed::isMathRuntimeCall(CallSite *call)
+{
+  if (MathRuntimeFile.empty())
+    return false;
+  Function *f = call->getCalledFunction();
+  return f && !getMathFunctionName(f).empty();
+}
+
+
+Function *FloatToFixed::getMathRuntimeFunction(Module& m, StringRef name, unsigned width)
+{
+  if (!mathRuntime) {
+    if (mathRuntimeLoadFailed)
+      return nullptr;
+    /* load the whole runtime and check it before any call is rewritten,
+     * so that linking it afterwards cannot fail because of the runtime */
+    SMDiagnostic err;
+    mathRuntime = parseIRFile(MathRuntimeFile, err, m.getContext());
+    if (!mathRuntime) {
+      errs() << "warning: cannot load the fixed point math runtime; using the floating point functions\n";
+      err.print("flttofix", errs());
+      mathRuntimeLoadFailed = true;
+      return nullptr;
+    }
+    if (verifyModule(*mathRuntime, &errs())) {
+      errs() << "warning: the fixed point math runtime is not valid; using the floating point functions\n";
+      mathRuntime.reset();
+      mathRuntimeLoadFailed = true;
+      return nullptr;
+    }
+  }
+  
+  std::string fname = ("flttofix_" + name + "_i" + Twine(width)).str();
+  Type *intTy = Type::getIntNTy(m.getContext(), width);
+  Type *int32Ty = Type::getInt32Ty(m.getContext());
+  FunctionType *rtFTy = FunctionType::get(intTy, {intTy, int32Ty, int32Ty}, false);
+  Function *rtF = mathRuntime->getFunction(fname);
+  if (!rtF || rtF->isDeclaration() || rtF->getFunctionType() != rtFTy) {
+    LLVM_DEBUG(dbgs() << "math runtime does not implement " << fname << "\n");
+    return nullptr;
+  }
+  /* the definition in the runtime would clash with the one of the module */
+  Function *modF = m.getFunction(fname);
+  if (modF && (!modF->isDeclaration() || modF->getFunctionType() != rtFTy)) {
+    LLVM_DEBUG(dbgs() << "module already defines " << fname << "; not using the math runtime\n");
+    return nullptr;
+  }
+  
+  FunctionCallee callee = m.getOrInsertFunction(fname, rtF->getFunctionType(), rtF->getAttributes());
+  mathRuntimeUsed.insert(fname);
+  return dyn_cast<Function>(callee.getCallee());
+}
+
+
+Value *FloatToFixed::convertMathCall(CallSite *call, FixedPointType& fixpt)
+{
+  Instruction *inst = call->getInstruction();
+  StringRef name = getMathFunctionName(call->getCalledFunction());
+  if (!call->isCall() || call->arg_size() != 1 || !inst->getType()->isFloatingPointTy())
+    return Unsupported;
+  if (!hasInfo(inst) || valueInfo(inst)->noTypeConversion)
+    return Unsupported;
+  
+  FixedPointType argfpt = fixpt;
+  Value *arg = translateOrMatchOperand(call->getArgument(0), argfpt, inst, TypeMatchPolicy::RangeOverHintMaxFrac);
+  if (!arg)
+    return nullptr;
+  
+  /* The runtime works on signed values; unsigned formats need one more bit */
+  int argbits = argfpt.scalarBitsAmt() + (argfpt.scalarIsSigned() ? 0 : 1);
+  int resbits = fixpt.scalarBitsAmt() + (fixpt.scalarIsSigned() ? 0 : 1);
+  int needbits = std::max(argbits, resbits);
+  if (needbits > 64)
+    return Unsupported;
+  unsigned width = needbits <= 32 ? 32 : 64;
+  
+  Function *rtF = getMathRuntimeFunction(*inst->getModule(), name, width);
+  if (!rtF)
+    return Unsupported;
+  
+  FixedPointType rtargfpt(true, argfpt.scalarFracBitsAmt(), width);
+  FixedPointType rtresfpt(true, fixpt.scalarFracBitsAmt(), width);
+  arg = genConvertFixedToFixed(arg, argfpt, rtargfpt, inst);
+  
+  IRBuilder<> builder(inst);
+  Value *args[] = {
+    arg,
+    builder.getInt32(argfpt.scalarFracBitsAmt()),
+    builder.getInt32(fixpt.scalarFracBitsAmt())
+  };
+  CallInst *res = builder.CreateCall(rtF, args);
+  cpMetaData(res, inst);
+  updateFPTypeMetadata(res, rtresfpt.scalarIsSigned(), rtresfpt.scalarFracBitsAmt(), rtresfpt.scalarBitsAmt());
+  MathRuntimeCallCount++;
+  return genConvertFixedToFixed(res, rtresfpt, fixpt, inst);
+}
+
+
+void FloatToFixed::linkMathRuntime(Module& m)
+{
+  if (!mathRuntime || mathRuntimeUsed.empty()) {
+    mathRuntime.reset();
+    return;
+  }
+  
+  /* the calls have been rewritten already; without the runtime the module
+   * would be left with unresolved references */
+  if (Linker::linkModules(m, std::move(mathRuntime), Linker::Flags::LinkOnlyNeeded))
+    report_fatal_error("flttofix: linking the fixed point math runtime failed");
+  
+  /* Allow the runtime functions to be inlined and specialized at each
+   * call site, and dropped afterwards */
+  for (const std::string& fname: mathRuntimeUsed) {
+    Function *f = m.getFunction(fname);
+    if (f && !f->isDeclaration()) {
+      f->setLinkage(GlobalValue::InternalLinkage);
+      f->addFnAttr(Attribute::InlineHint);
+    }
+  }
+  mathRuntime.reset();
+  mathRuntimeUsed.clear();
+}
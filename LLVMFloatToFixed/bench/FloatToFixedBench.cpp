@@ -0,0 +1,348 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "LLVMFloatToFixedPass.h"
+#include "Metadata.h"
+#include "InputInfo.h"
+
+
+using namespace llvm;
+using namespace flttofix;
+using namespace mdutils;
+
+
+/* Generates a synthetic annotated module and converts it with the
+ * flttofix pass, reporting the wall time and the peak RSS of the
+ * conversion. The -flttofix-* options of the pass are accepted as well.
+ *
+ * Shape of the module: the functions are arranged in call chains of
+ * -call-depth functions, the first one of each chain being called by
+ * the root function and the others being function templates specialized
+ * by the pass. Each function reads a global (arrays and structs of float
+ * alternate), runs -loops loops carrying -phis floating point phis each,
+ * in which every value computed from a phi has -fanout users, and
+ * finally calls the next function of its chain. */
+
+static cl::opt<unsigned> NumValues("values",
+  cl::desc("Approximate number of annotated values of the module"),
+  cl::init(1000));
+
+static cl::opt<unsigned> NumFunctions("functions",
+  cl::desc("Number of functions (0 = one every 200 values)"),
+  cl::init(0));
+
+static cl::opt<unsigned> CallDepth("call-depth",
+  cl::desc("Length of the call chains"),
+  cl::init(4));
+
+static cl::opt<unsigned> NumLoops("loops",
+  cl::desc("Number of loops in each function"),
+  cl::init(2));
+
+static cl::opt<unsigned> NumPhis("phis",
+  cl::desc("Number of floating point phis of each loop"),
+  cl::init(4));
+
+static cl::opt<unsigned> NumGlobals("globals",
+  cl::desc("Number of global arrays and structs"),
+  cl::init(16));
+
+static cl::opt<unsigned> FanOut("fanout",
+  cl::desc("Number of users of each value computed from a phi"),
+  cl::init(4));
+
+static cl::opt<std::string> EmitModule("emit",
+  cl::desc("Write the generated module to the given bitcode file instead of converting it"),
+  cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> ResultsFile("results",
+  cl::desc("Append the results as a JSON line to the given file (default: standard output)"),
+  cl::value_desc("file"), cl::init(""));
+
+
+static unsigned getNumFunctions()
+{
+  return NumFunctions ? (unsigned)NumFunctions : std::max(1U, NumValues / 200);
+}
+
+
+namespace {
+
+/** Length of the global arrays and trip count of the loops */
+const unsigned ArrayLength = 16;
+
+
+class SyntheticModuleBuilder {
+  LLVMContext& ctxt;
+  std::unique_ptr<Module> m;
+  Type *floatTy;
+  std::vector<GlobalVariable *> globals;
+  /** Number of annotated values so far */
+  unsigned numAnnotated = 0;
+
+  /** Annotates a value with a 32 bit fixed point type. Ranges vary from
+   *  value to value like the ones computed by the range analysis. */
+  void annotate(Value *v)
+  {
+    InputInfo ii;
+    ii.IType.reset(new FPType(32, 20, true));
+    double bound = 1.0 + (numAnnotated % 1000);
+    ii.IRange.reset(new Range(-bound, bound));
+    ii.IEnableConversion = true;
+    MetadataManager::setMDInfoMetadata(v, &ii);
+    numAnnotated++;
+  }
+
+  void createGlobals()
+  {
+    Type *arrayTy = ArrayType::get(floatTy, ArrayLength);
+    StructType *structTy = StructType::create(ctxt, {floatTy, floatTy}, "bench.pair");
+    for (unsigned i = 0; i < NumGlobals; i++) {
+      bool isArray = i % 2 == 0;
+      Type *ty = isArray ? arrayTy : (Type *)structTy;
+      GlobalVariable *gv = new GlobalVariable(*m, ty, false, GlobalValue::InternalLinkage,
+        Constant::getNullValue(ty), "bench.global." + Twine(i));
+      if (isArray) {
+        annotate(gv);
+      } else {
+        auto field = [&]() {
+          auto ii = std::make_shared<InputInfo>();
+          ii->IType.reset(new FPType(32, 20, true));
+          ii->IRange.reset(new Range(-1000.0, 1000.0));
+          ii->IEnableConversion = true;
+          return std::shared_ptr<MDInfo>(ii);
+        };
+        StructInfo si({field(), field()});
+        MetadataManager::setMDInfoMetadata(gv, &si);
+        numAnnotated++;
+      }
+      globals.push_back(gv);
+    }
+  }
+
+  /** Returns a pointer to a float element of a global */
+  Value *getGlobalElement(IRBuilder<>& builder, unsigned n)
+  {
+    GlobalVariable *gv = globals[n % globals.size()];
+    unsigned idx = gv->getValueType()->isArrayTy() ? n % ArrayLength : n % 2;
+    Value *gep = builder.CreateInBoundsGEP(gv->getValueType(), gv, {builder.getInt32(0), builder.getInt32(idx)});
+    annotate(gep);
+    return gep;
+  }
+
+  /** Emits a loop updating numPhis accumulators initialized to init, with
+   *  about numValues annotated values in the body.
+   *  @returns The value of the first accumulator at the exit of the loop */
+  Value *createLoop(IRBuilder<>& builder, Value *init, unsigned numValues)
+  {
+    Function *f = builder.GetInsertBlock()->getParent();
+    BasicBlock *pred = builder.GetInsertBlock();
+    BasicBlock *body = BasicBlock::Create(ctxt, "loop", f);
+    BasicBlock *exit = BasicBlock::Create(ctxt, "loop.exit", f);
+    builder.CreateBr(body);
+
+    builder.SetInsertPoint(body);
+    PHINode *iv = builder.CreatePHI(builder.getInt32Ty(), 2, "iv");
+    iv->addIncoming(builder.getInt32(0), pred);
+    std::vector<PHINode *> phis;
+    std::vector<Value *> next;
+    for (unsigned i = 0; i < std::max(1U, (unsigned)NumPhis); i++) {
+      PHINode *phi = builder.CreatePHI(floatTy, 2, "acc");
+      phi->addIncoming(init, pred);
+      annotate(phi);
+      phis.push_back(phi);
+      next.push_back(phi);
+    }
+
+    /* each group reads one accumulator, uses it fanout times and sums the
+     * results back into the accumulator */
+    unsigned fanout = std::max(1U, (unsigned)FanOut);
+    unsigned end = numAnnotated + numValues;
+    for (unsigned g = 0; numAnnotated < end; g++) {
+      Value *&acc = next[g % next.size()];
+      Value *sum = nullptr;
+      for (unsigned u = 0; u < fanout; u++) {
+        Value *prod = builder.CreateFMul(acc, ConstantFP::get(floatTy, 0.3 + 0.1 * u));
+        annotate(prod);
+        if (sum) {
+          sum = builder.CreateFAdd(sum, prod);
+          annotate(sum);
+        } else {
+          sum = prod;
+        }
+      }
+      acc = sum;
+    }
+
+    Value *ivnext = builder.CreateAdd(iv, builder.getInt32(1));
+    iv->addIncoming(ivnext, body);
+    for (unsigned i = 0; i < phis.size(); i++)
+      phis[i]->addIncoming(next[i], body);
+    builder.CreateCondBr(builder.CreateICmpULT(ivnext, builder.getInt32(ArrayLength)), body, exit);
+
+    builder.SetInsertPoint(exit);
+    return next[0];
+  }
+
+  /** Defines the body of a function of type float (float) */
+  void createBody(Function *f, Function *callee, unsigned id, unsigned numValues)
+  {
+    IRBuilder<> builder(BasicBlock::Create(ctxt, "entry", f));
+    Argument *arg = &*f->arg_begin();
+    InputInfo argInfo;
+    argInfo.IType.reset(new FPType(32, 20, true));
+    argInfo.IRange.reset(new Range(-1000.0, 1000.0));
+    argInfo.IEnableConversion = true;
+    MetadataManager::setArgumentInputInfoMetadata(*f, {&argInfo});
+    numAnnotated++;
+
+    LoadInst *ld = builder.CreateLoad(floatTy, getGlobalElement(builder, id));
+    annotate(ld);
+    Value *v = builder.CreateFAdd(arg, ld);
+    annotate(v);
+
+    unsigned loops = std::max(1U, (unsigned)NumLoops);
+    for (unsigned i = 0; i < loops; i++)
+      v = createLoop(builder, v, numValues / loops);
+
+    if (callee) {
+      CallInst *call = builder.CreateCall(callee, {v});
+      annotate(call);
+      v = builder.CreateFAdd(v, call);
+      annotate(v);
+    }
+    builder.CreateStore(v, getGlobalElement(builder, id + 1));
+    builder.CreateRet(v);
+  }
+
+public:
+  SyntheticModuleBuilder(LLVMContext& c) : ctxt(c), m(new Module("flttofix-bench", c)) {
+    floatTy = Type::getFloatTy(c);
+  }
+
+  unsigned getNumAnnotated() const {
+    return numAnnotated;
+  }
+
+  std::unique_ptr<Module> build()
+  {
+    createGlobals();
+
+    unsigned numFunctions = getNumFunctions();
+    unsigned depth = std::max(1U, (unsigned)CallDepth);
+    unsigned perFunction = std::max(1U, NumValues / numFunctions);
+    FunctionType *funTy = FunctionType::get(floatTy, {floatTy}, false);
+
+    /* create the functions first, so that each chain can be built from
+     * its end */
+    std::vector<Function *> funs;
+    for (unsigned i = 0; i < numFunctions; i++) {
+      Function *f = Function::Create(funTy, GlobalValue::InternalLinkage, "bench.fun." + Twine(i), m.get());
+      if (i % depth != 0) {
+        /* callees are function templates, specialized by the pass on the
+         * formats at the call site; the pass only checks for the presence
+         * of the source function metadata */
+        f->setMetadata(SOURCE_FUN_METADATA, MDNode::get(ctxt, ValueAsMetadata::get(f)));
+      }
+      funs.push_back(f);
+    }
+    for (unsigned i = 0; i < numFunctions; i++) {
+      bool last = i + 1 == numFunctions || (i + 1) % depth == 0;
+      createBody(funs[i], last ? nullptr : funs[i + 1], i, perFunction);
+    }
+
+    /* the root calls the first function of every chain */
+    Function *root = Function::Create(funTy, GlobalValue::ExternalLinkage, "bench.root", m.get());
+    IRBuilder<> builder(BasicBlock::Create(ctxt, "entry", root));
+    Value *v = &*root->arg_begin();
+    for (unsigned i = 0; i < numFunctions; i += depth)
+      v = builder.CreateCall(funs[i], {v});
+    builder.CreateRet(v);
+
+    return std::move(m);
+  }
+};
+
+}
+
+
+int main(int argc, char **argv)
+{
+  InitLLVM x(argc, argv);
+  PassRegistry& registry = *PassRegistry::getPassRegistry();
+  initializeCore(registry);
+  initializeAnalysis(registry);
+  cl::ParseCommandLineOptions(argc, argv, "flttofix scaling benchmark\n");
+
+  LLVMContext ctxt;
+  double start = TimeRecord::getCurrentTime(true).getWallTime();
+  SyntheticModuleBuilder smb(ctxt);
+  std::unique_ptr<Module> m = smb.build();
+  double generationTime = TimeRecord::getCurrentTime(false).getWallTime() - start;
+  if (verifyModule(*m, &errs())) {
+    errs() << "error: the generated module is not valid\n";
+    return 1;
+  }
+
+  if (!EmitModule.empty()) {
+    std::error_code ec;
+    raw_fd_ostream out(EmitModule, ec, sys::fs::OF_None);
+    if (ec) {
+      errs() << "error: cannot write " << EmitModule << ": " << ec.message() << "\n";
+      return 1;
+    }
+    WriteBitcodeToFile(*m, out);
+    return 0;
+  }
+
+  size_t rssBefore = getPeakResidentSetSize();
+  legacy::PassManager pm;
+  pm.add(new FloatToFixed());
+  start = TimeRecord::getCurrentTime(true).getWallTime();
+  pm.run(*m);
+  double conversionTime = TimeRecord::getCurrentTime(false).getWallTime() - start;
+  size_t rssAfter = getPeakResidentSetSize();
+
+  json::Object result{
+    {"values", (int64_t)NumValues},
+    {"annotated", (int64_t)smb.getNumAnnotated()},
+    {"functions", (int64_t)getNumFunctions()},
+    {"call_depth", (int64_t)CallDepth},
+    {"loops", (int64_t)NumLoops},
+    {"phis", (int64_t)NumPhis},
+    {"globals", (int64_t)NumGlobals},
+    {"fanout", (int64_t)FanOut},
+    {"generation_time", generationTime},
+    {"wall_time", conversionTime},
+    {"peak_rss_before_bytes", (int64_t)rssBefore},
+    {"peak_rss_bytes", (int64_t)rssAfter}};
+
+  if (ResultsFile.empty()) {
+    outs() << json::Value(std::move(result)) << "\n";
+    return 0;
+  }
+  std::error_code ec;
+  raw_fd_ostream out(ResultsFile, ec, sys::fs::OF_Append | sys::fs::OF_Text);
+  if (ec) {
+    errs() << "error: cannot write " << ResultsFile << ": " << ec.message() << "\n";
+    return 1;
+  }
+  out << json::Value(std::move(result)) << "\n";
+  return 0;
+}
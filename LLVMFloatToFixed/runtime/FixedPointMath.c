@@ -0,0 +1,285 @@
+/* Integer-only implementations of the elementary math functions, used by
+ * flttofix to replace calls to sqrt, exp, log, sin and cos whose argument
+ * and result are converted to fixed point.
+ *
+ * This file is compiled to a bitcode module which the pass links into the
+ * converted module (see -flttofix-math-runtime). Every function takes the
+ * amount of fractional bits of the argument and of the result as
+ * parameters; they are always constants at the call site, therefore after
+ * inlining the code is specialized for the fixed point formats involved.
+ *
+ * Internally all computations are performed in Q30 on 64 bit integers. */
+
+#include <stdint.h>
+
+
+#define Q30_ONE ((int64_t)1 << 30)
+#define Q30_LN2 INT64_C(744261118)
+#define Q30_SQRT2 INT64_C(1518500250)
+#define Q30_PI INT64_C(3373259426)
+#define Q30_TWO_PI INT64_C(6746518852)
+#define Q30_HALF_PI INT64_C(1686629713)
+#define Q60_TWO_PI INT64_C(7244019458077122560)
+/* log2(e) - 1 in Q28 */
+#define Q28_LOG2E_M1 INT64_C(118835045)
+/* Gain of the CORDIC rotations */
+#define Q30_CORDIC_K INT64_C(652032874)
+#define CORDIC_ITERATIONS 30
+
+
+/* atan(2^-i) in Q30 */
+static const int32_t cordicAtan[CORDIC_ITERATIONS] = {
+  843314857, 497837829, 263043837, 133525159, 67021687, 33543516, 16775851,
+  8388437, 4194283, 2097149, 1048576, 524288, 262144, 131072, 65536, 32768,
+  16384, 8192, 4096, 2048, 1024, 512, 256, 128, 64, 32, 16, 8, 4, 2
+};
+
+/* ln(2)^k / k! in Q30, for k = 8 down to 0 */
+static const int32_t exp2Coeffs[] = {
+  1419, 16377, 165394, 1431680, 10327387, 59597083, 257941248, 744261118,
+  1073741824
+};
+
+/* 2 / k in Q30, for k = 9, 7, 5, 3, 1 */
+static const int64_t atanhCoeffs[] = {
+  238609294, 306783378, 429496730, 715827883, INT64_C(2147483648)
+};
+
+
+static int clz64(uint64_t x)
+{
+  return x ? __builtin_clzll(x) : 64;
+}
+
+
+static int64_t shiftSat(int64_t x, int sh)
+{
+  if (sh <= 0) {
+    if (sh <= -63)
+      return x < 0 ? -1 : 0;
+    return x >> -sh;
+  }
+  if (sh >= 63)
+    return x == 0 ? 0 : (x < 0 ? INT64_MIN : INT64_MAX);
+  if (x > (INT64_MAX >> sh))
+    return INT64_MAX;
+  if (x < (INT64_MIN >> sh))
+    return INT64_MIN;
+  return x * ((int64_t)1 << sh);
+}
+
+
+static int32_t sat32(int64_t x)
+{
+  if (x > INT32_MAX)
+    return INT32_MAX;
+  if (x < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)x;
+}
+
+
+static int64_t toQ30(int64_t x, int frac)
+{
+  return shiftSat(x, 30 - frac);
+}
+
+
+static int64_t fromQ30(int64_t x, int frac)
+{
+  return shiftSat(x, frac - 30);
+}
+
+
+static uint64_t isqrt64(uint64_t v)
+{
+  uint64_t res = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > v)
+    bit >>= 2;
+  while (bit != 0) {
+    if (v >= res + bit) {
+      v -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return res;
+}
+
+
+int64_t flttofix_sqrt_i64(int64_t x, int32_t xfrac, int32_t rfrac)
+{
+  if (x <= 0)
+    return 0;
+  
+  /* r = sqrt(x * 2^s) */
+  uint64_t v = (uint64_t)x;
+  int s = 2 * rfrac - xfrac;
+  if (s & 1) {
+    v <<= 1;
+    s -= 1;
+  }
+  if (s > 0) {
+    int k = clz64(v) & ~1;
+    if (k > s)
+      k = s;
+    v <<= k;
+    s -= k;
+  } else if (s < 0) {
+    v = -s < 64 ? v >> -s : 0;
+    s = 0;
+  }
+  return shiftSat((int64_t)isqrt64(v), s / 2);
+}
+
+
+int32_t flttofix_sqrt_i32(int32_t x, int32_t xfrac, int32_t rfrac)
+{
+  return sat32(flttofix_sqrt_i64(x, xfrac, rfrac));
+}
+
+
+int64_t flttofix_exp_i64(int64_t x, int32_t xfrac, int32_t rfrac)
+{
+  /* exp(x) = 2^(x * log2(e)); beyond +-44 the result saturates any
+   * 64 bit format */
+  int64_t xq = toQ30(x, xfrac);
+  if (xq > 44 * Q30_ONE)
+    return INT64_MAX;
+  if (xq < -44 * Q30_ONE)
+    return 0;
+  int64_t y = xq + ((xq * Q28_LOG2E_M1) >> 28);
+  
+  /* y = n + f, with f in [-0.5, 0.5) */
+  int64_t n = y >> 30;
+  int64_t f = y - n * Q30_ONE;
+  if (f >= Q30_ONE / 2) {
+    f -= Q30_ONE;
+    n += 1;
+  }
+  
+  int64_t p = 0;
+  for (unsigned i = 0; i < sizeof(exp2Coeffs) / sizeof(exp2Coeffs[0]); i++)
+    p = exp2Coeffs[i] + ((p * f) >> 30);
+  return shiftSat(p, (int)n + rfrac - 30);
+}
+
+
+int32_t flttofix_exp_i32(int32_t x, int32_t xfrac, int32_t rfrac)
+{
+  return sat32(flttofix_exp_i64(x, xfrac, rfrac));
+}
+
+
+int64_t flttofix_log_i64(int64_t x, int32_t xfrac, int32_t rfrac)
+{
+  if (x <= 0)
+    return INT64_MIN;
+  
+  /* x = m * 2^e, with m in [sqrt(2)/2, sqrt(2)) */
+  uint64_t v = (uint64_t)x;
+  int e = 63 - clz64(v);
+  int64_t m = (int64_t)(e > 30 ? v >> (e - 30) : v << (30 - e));
+  if (m > Q30_SQRT2) {
+    m >>= 1;
+    e += 1;
+  }
+  
+  /* ln(m) = 2 * atanh(z), with z = (m - 1) / (m + 1) */
+  int64_t z = ((m - Q30_ONE) * Q30_ONE) / (m + Q30_ONE);
+  int64_t z2 = (z * z) >> 30;
+  int64_t t = 0;
+  for (unsigned i = 0; i < sizeof(atanhCoeffs) / sizeof(atanhCoeffs[0]); i++)
+    t = atanhCoeffs[i] + ((t * z2) >> 30);
+  int64_t lnm = (t * z) >> 30;
+  
+  return fromQ30((int64_t)(e - xfrac) * Q30_LN2 + lnm, rfrac);
+}
+
+
+int32_t flttofix_log_i32(int32_t x, int32_t xfrac, int32_t rfrac)
+{
+  return sat32(flttofix_log_i64(x, xfrac, rfrac));
+}
+
+
+/* Computes the sine and the cosine of x in Q30 with CORDIC */
+static void sinCosQ30(int64_t x, int xfrac, int64_t *sinres, int64_t *cosres)
+{
+  /* reduce the angle to [-pi, pi] in Q30; angles too large to be
+   * represented in Q30 are first reduced in the format of x */
+  int64_t a;
+  if (xfrac < 30) {
+    int sh = 30 - xfrac;
+    if (x > (INT64_MAX >> sh) || x < (INT64_MIN >> sh))
+      x %= Q60_TWO_PI >> (60 - xfrac);
+    a = x * ((int64_t)1 << sh);
+  } else {
+    a = xfrac - 30 < 63 ? x >> (xfrac - 30) : (x < 0 ? -1 : 0);
+  }
+  a %= Q30_TWO_PI;
+  if (a > Q30_PI)
+    a -= Q30_TWO_PI;
+  else if (a < -Q30_PI)
+    a += Q30_TWO_PI;
+  
+  /* CORDIC only converges in [-pi/2, pi/2] */
+  int negate = 0;
+  if (a > Q30_HALF_PI) {
+    a -= Q30_PI;
+    negate = 1;
+  } else if (a < -Q30_HALF_PI) {
+    a += Q30_PI;
+    negate = 1;
+  }
+  
+  int64_t cx = Q30_CORDIC_K, cy = 0;
+  for (int i = 0; i < CORDIC_ITERATIONS; i++) {
+    int64_t nx, ny;
+    if (a >= 0) {
+      nx = cx - (cy >> i);
+      ny = cy + (cx >> i);
+      a -= cordicAtan[i];
+    } else {
+      nx = cx + (cy >> i);
+      ny = cy - (cx >> i);
+      a += cordicAtan[i];
+    }
+    cx = nx;
+    cy = ny;
+  }
+  
+  *sinres = negate ? -cy : cy;
+  *cosres = negate ? -cx : cx;
+}
+
+
+int64_t flttofix_sin_i64(int64_t x, int32_t xfrac, int32_t rfrac)
+{
+  int64_t s, c;
+  sinCosQ30(x, xfrac, &s, &c);
+  return fromQ30(s, rfrac);
+}
+
+
+int32_t flttofix_sin_i32(int32_t x, int32_t xfrac, int32_t rfrac)
+{
+  return sat32(flttofix_sin_i64(x, xfrac, rfrac));
+}
+
+
+int64_t flttofix_cos_i64(int64_t x, int32_t xfrac, int32_t rfrac)
+{
+  int64_t s, c;
+  sinCosQ30(x, xfrac, &s, &c);
+  return fromQ30(c, rfrac);
+}
+
+
+int32_t flttofix_cos_i32(int32_t x, int32_t xfrac, int32_t rfrac)
+{
+  return sat32(flttofix_cos_i64(x, xfrac, rfrac));
+}